@@ -0,0 +1,217 @@
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+
+#include "queue.h"
+
+namespace queue_sim {
+
+// ----------------------------
+// PairedDifference: mean of the per-batch differences between a variant and the baseline,
+// with the confidence interval
+
+class PairedDifference {
+public:
+    void Add(double difference) {
+        // Welford's online mean and variance
+        ++Count;
+        double delta = difference - Mean;
+        Mean += delta / Count;
+        M2 += delta * (difference - Mean);
+    }
+
+    size_t GetCount() const {
+        return Count;
+    }
+
+    double GetMean() const {
+        return Mean;
+    }
+
+    // half-width of the 95% confidence interval of the mean, 0 until there are 2 samples
+    double GetConfidence95() const {
+        if (Count < 2) {
+            return 0;
+        }
+
+        double variance = M2 / (Count - 1);
+        return StudentT975(Count - 1) * std::sqrt(variance / Count);
+    }
+
+private:
+    static double StudentT975(size_t degreesOfFreedom) {
+        static constexpr double table[] = {
+            12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+            2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+            2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042,
+        };
+        constexpr size_t tableSize = sizeof(table) / sizeof(table[0]);
+
+        if (degreesOfFreedom == 0) {
+            return 0;
+        }
+        if (degreesOfFreedom <= tableSize) {
+            return table[degreesOfFreedom - 1];
+        }
+
+        // normal approximation
+        return 1.96;
+    }
+
+private:
+    size_t Count = 0;
+    double Mean = 0;
+    double M2 = 0;
+};
+
+// ----------------------------
+// ABComparison: runs pipeline variants in lockstep on the same seed, so that the same
+// event gets the same class, size and latency draws in every variant (common random
+// numbers). Time is split into batches, and for each variant the per-batch differences
+// from the first variant (baseline) are accumulated. Because the noise is shared, the
+// paired differences converge much faster than the ones of independent runs.
+
+class ABComparison {
+public:
+    struct Variant {
+        const char* Name;
+        std::function<void(ClosedPipeLine&)> Setup;
+    };
+
+    ABComparison(
+            Sprite sprite,
+            std::vector<Variant> variants,
+            TimeNs batchTime = 50 * Msec,
+            TimeNs warmupTime = 100 * Msec,
+            uint64_t seed = RandomSeed())
+        : Variants(std::move(variants))
+        , BatchTime(batchTime)
+        , WarmupTime(warmupTime)
+        , Differences(Variants.size())
+        , _Sprite(sprite)
+    {
+        if (Variants.size() < 2) {
+            throw std::runtime_error("A/B comparison needs at least 2 variants");
+        }
+        if (BatchTime <= 0) {
+            throw std::runtime_error("Batch time must be positive");
+        }
+
+        const Si32 reportHeight = GetReportHeight();
+        const Si32 rowHeight = (_Sprite.Height() - reportHeight) / (Si32)Variants.size();
+
+        for (size_t i = 0; i < Variants.size(); ++i) {
+            // the baseline is at the top
+            Sprite rowSprite;
+            Si32 y = reportHeight + (Si32)(Variants.size() - 1 - i) * rowHeight;
+            rowSprite.Reference(_Sprite, 0, y, _Sprite.Width(), rowHeight);
+            RowSprites.push_back(rowSprite);
+
+            Pipelines.emplace_back(new ClosedPipeLine(rowSprite, seed));
+            Pipelines.back()->EnableBatchStats();
+            Variants[i].Setup(*Pipelines.back());
+        }
+    }
+
+    void Tick(TimeNs dt) {
+        for (auto& pipeline: Pipelines) {
+            pipeline->Tick(dt);
+        }
+
+        TimePassed += dt;
+        BatchTimePassed += dt;
+        if (BatchTimePassed >= BatchTime) {
+            CloseBatch();
+        }
+    }
+
+public:
+    void Draw() {
+        for (size_t i = 0; i < Pipelines.size(); ++i) {
+            Pipelines[i]->Draw();
+            GetFont().Draw(RowSprites[i], Variants[i].Name, 5, RowSprites[i].Height() - 25);
+        }
+
+        std::string text;
+        for (size_t i = 1; i < Variants.size(); ++i) {
+            text += FormatDifference(i) + "\n";
+        }
+        GetFont().Draw(_Sprite, text.c_str(), 5, 5);
+    }
+
+    void PrintReport() const {
+        std::printf("A/B comparison, baseline: %s, batch: %.3f s\n", Variants[0].Name, ToSeconds(BatchTime));
+        for (size_t i = 1; i < Variants.size(); ++i) {
+            std::printf("%s\n", FormatDifference(i).c_str());
+        }
+    }
+
+private:
+    struct Metrics {
+        PairedDifference Rps;
+        PairedDifference P50Us;
+        PairedDifference P90Us;
+        PairedDifference P99Us;
+    };
+
+    void CloseBatch() {
+        std::vector<ClosedPipeLine::BatchStats> stats;
+        for (auto& pipeline: Pipelines) {
+            stats.push_back(pipeline->TakeBatchStats());
+        }
+
+        // batches overlapping the warmup are dropped
+        bool isWarm = TimePassed - BatchTimePassed >= WarmupTime;
+        BatchTimePassed = 0;
+        if (!isWarm) {
+            return;
+        }
+
+        const auto& baseline = stats[0];
+        for (size_t i = 1; i < stats.size(); ++i) {
+            auto& metrics = Differences[i];
+            metrics.Rps.Add(stats[i].Rps - baseline.Rps);
+            metrics.P50Us.Add((double)(stats[i].P50 - baseline.P50) / Usec);
+            metrics.P90Us.Add((double)(stats[i].P90 - baseline.P90) / Usec);
+            metrics.P99Us.Add((double)(stats[i].P99 - baseline.P99) / Usec);
+        }
+    }
+
+    std::string FormatDifference(size_t variant) const {
+        const auto& metrics = Differences[variant];
+
+        char text[512];
+        snprintf(text, sizeof(text),
+            "%s - %s (%ld batches): RPS %+.0f +- %.0f, p50 %+.1f +- %.1f us, p90 %+.1f +- %.1f us, p99 %+.1f +- %.1f us",
+            Variants[variant].Name,
+            Variants[0].Name,
+            metrics.Rps.GetCount(),
+            metrics.Rps.GetMean(), metrics.Rps.GetConfidence95(),
+            metrics.P50Us.GetMean(), metrics.P50Us.GetConfidence95(),
+            metrics.P90Us.GetMean(), metrics.P90Us.GetConfidence95(),
+            metrics.P99Us.GetMean(), metrics.P99Us.GetConfidence95());
+        return text;
+    }
+
+    Si32 GetReportHeight() const {
+        return 10 + 20 * (Si32)(Variants.size() - 1);
+    }
+
+private:
+    std::vector<Variant> Variants;
+    std::vector<std::unique_ptr<ClosedPipeLine>> Pipelines;
+
+    TimeNs BatchTime;
+    TimeNs WarmupTime;
+    TimeNs TimePassed = 0;
+    TimeNs BatchTimePassed = 0;
+
+    std::vector<Metrics> Differences; // indexed by variant, the baseline is unused
+
+private:
+    Sprite _Sprite;
+    std::vector<Sprite> RowSprites;
+};
+
+} // namespace queue_sim
@@ -2,25 +2,61 @@
 
 #include "engine/easy.h"
 
+#include "ab_comparison.h"
+#include "optimizer.h"
 #include "queue.h"
 
 using namespace arctic;  // NOLINT
 using namespace queue_sim;  // NOLINT
 
-constexpr double updateScreenInterval = 0.8;
-constexpr double tickInterval = 1 * Usec;
+enum class RunMode {
+    Interactive,
+    InteractiveChunkHeavy,
+    InteractiveMultiThreaded,
+    Optimize,
+    Compare,
+};
 
-void SetupCurrentPdiskModel(ClosedPipeLine &pipeline) {
-    constexpr size_t startQueueSize = 32;
+constexpr RunMode runMode = RunMode::Interactive;
+
+constexpr TimeNs updateScreenInterval = 800 * Msec;
+constexpr TimeNs tickInterval = 1 * Usec;
 
-    constexpr size_t pdiskThreads = 1;
-    constexpr double pdiskExecTime = 5 * Usec;
+// 4 KiB log writes with the given percent of 128 KiB chunk I/Os. Without chunk I/Os the model
+// is limited by PDisk CPU as the fixed-time one, enough of them make the NVMe bandwidth-bound
+Workload::Items PdiskWorkloadMix(size_t chunkPercent) {
+    chunkPercent = std::min<size_t>(chunkPercent, 100);
+    return {
+        {EventType::LogWrite, 4 * KiB, 100.0 - chunkPercent},
+        {EventType::ChunkWrite, 128 * KiB, chunkPercent * 0.6},
+        {EventType::ChunkRead, 128 * KiB, chunkPercent * 0.4},
+    };
+}
 
-    constexpr size_t smbThreads = 1;
-    constexpr double smbExecTime = 2 * Usec;
+constexpr size_t CurrentChunkPercent = 0;
+constexpr size_t ChunkHeavyChunkPercent = 25;
 
-    constexpr size_t NVMeInflight = 128;
-    PercentileTimeProcessor::Percentiles diskPercentilesUs = {
+// indexed by EventType. A 4 KiB log write costs 5 us in PDisk and 2 us in Smb
+SizeScaledTimeProcessor::ServiceModels CurrentPdiskServiceModels() {
+    return {{
+        {4900 * Nsec, 25 * Nsec},  // LogWrite
+        {4 * Usec, 25 * Nsec},     // ChunkWrite
+        {3 * Usec, 10 * Nsec},     // ChunkRead
+        {2 * Usec, 0},             // Flush
+    }};
+}
+
+SizeScaledTimeProcessor::ServiceModels CurrentSmbServiceModels() {
+    return {{
+        {1960 * Nsec, 10 * Nsec},  // LogWrite
+        {2 * Usec, 10 * Nsec},     // ChunkWrite
+        {2 * Usec, 5 * Nsec},      // ChunkRead
+        {1 * Usec, 0},             // Flush
+    }};
+}
+
+PercentileTimeProcessor::Percentiles CurrentNVMePercentiles() {
+    return {
         {16.47, 12 * Usec},
         {87.26, 25 * Usec},
         {99.7, 50 * Usec},
@@ -28,52 +64,267 @@ void SetupCurrentPdiskModel(ClosedPipeLine &pipeline) {
         {99.9968, 200 * Usec},
         {1000, 4000 * Usec},
     };
+}
+
+PercentileTimeProcessor::Percentiles SlowNVMePercentiles() {
+    return {
+        {3.813, 12 * Usec},
+        {51.59, 25 * Usec},
+        {98.851, 50 * Usec},
+        {99.956, 100 * Usec},
+        {99.983, 200 * Usec},
+        {99.983, 200 * Usec},
+        {1000, 4000 * Usec},
+    };
+}
+
+// cost knob scales all per-class service models, in percents of the initial ones
+void AddServiceCostKnob(
+    ModelControls& controls,
+    std::string name,
+    Executor<SizeScaledTimeProcessor>* executor)
+{
+    auto initialModels = executor->GetPrototype().GetServiceModels();
+    auto scalePercent = std::make_shared<int>(100);
 
+    controls.AddKnob(
+        std::move(name),
+        [scalePercent] {
+            return std::to_string(*scalePercent) + "%";
+        },
+        [executor, initialModels, scalePercent](int direction) {
+            *scalePercent = std::max(10, *scalePercent + direction * 10);
+
+            auto models = initialModels;
+            for (auto& model: models) {
+                model.BaseTime = model.BaseTime * *scalePercent / 100;
+                model.PerKiBTime = model.PerKiBTime * *scalePercent / 100;
+            }
+
+            executor->Reconfigure([&models](SizeScaledTimeProcessor& processor) {
+                processor.SetServiceModels(models);
+            });
+        });
+}
+
+// the knob changes the mix of the events generated from now on, to find where the device
+// becomes bandwidth-bound
+void AddChunkShareKnob(ModelControls& controls, std::string name, ClosedPipeLine* pipeline, size_t initialChunkPercent) {
+    auto chunkPercent = std::make_shared<size_t>(initialChunkPercent);
+
+    controls.AddKnob(
+        std::move(name),
+        [chunkPercent] {
+            return std::to_string(*chunkPercent) + "%";
+        },
+        [pipeline, chunkPercent](int direction) {
+            constexpr size_t step = 5;
+            if (direction > 0) {
+                *chunkPercent = std::min<size_t>(100, *chunkPercent + step);
+            } else if (*chunkPercent >= step) {
+                *chunkPercent -= step;
+            }
+            pipeline->SetWorkload(Workload(PdiskWorkloadMix(*chunkPercent)));
+        });
+}
+
+// the step function of the percentile tables puts most I/Os into a few fixed values
+constexpr LatencyInterpolation NVMeInterpolation = LatencyInterpolation::LogLinear;
+
+void AddLatencyShapeKnob(ModelControls& controls, std::string name, DeviceExecutor* device) {
+    controls.AddKnob(
+        std::move(name),
+        [device] {
+            return std::string(LatencyInterpolationName(device->GetPrototype().GetDistribution().GetInterpolation()));
+        },
+        [device](int direction) {
+            constexpr int interpolationCount = (int)LatencyInterpolation::ParetoTail + 1;
+            auto current = device->GetPrototype().GetDistribution().GetInterpolation();
+            auto interpolation = (LatencyInterpolation)(((int)current + interpolationCount + direction) % interpolationCount);
+            device->Reconfigure([interpolation](DeviceProcessor& processor) {
+                processor.SetInterpolation(interpolation);
+            });
+        });
+}
+
+using NamedPercentiles = std::pair<const char*, PercentileTimeProcessor::Percentiles>;
+
+std::vector<NamedPercentiles> NVMeTables() {
+    return {
+        {"current", CurrentNVMePercentiles()},
+        {"slow", SlowNVMePercentiles()},
+    };
+}
+
+struct PdiskModelStages {
+    Executor<SizeScaledTimeProcessor>* PDisk = nullptr;
+    Executor<SizeScaledTimeProcessor>* Smb = nullptr;
+    DeviceExecutor* NVMe = nullptr;
+};
+
+PdiskModelStages SetupPdiskModel(
+    ClosedPipeLine &pipeline,
+    const PdiskModelParameters& parameters,
+    size_t NVMeTable,
+    size_t chunkPercent = CurrentChunkPercent)
+{
+    constexpr size_t startQueueSize = 32;
+    constexpr size_t NVMeBandwidth = 3 * GiB;
+
+    pipeline.SetWorkload(Workload(PdiskWorkloadMix(chunkPercent)));
+
+    PdiskModelStages stages;
     pipeline.AddQueue("InputQ", startQueueSize);
-    pipeline.AddFixedTimeExecutor("PDisk", pdiskThreads, pdiskExecTime);
+    stages.PDisk = pipeline.AddSizeScaledExecutor("PDisk", parameters.PDiskThreads, CurrentPdiskServiceModels());
     pipeline.AddQueue("SubmitQ", 0);
-    pipeline.AddFixedTimeExecutor("Smb", smbThreads, smbExecTime);
-    pipeline.AddPercentileTimeExecutor("NVMe", NVMeInflight, diskPercentilesUs);
+    stages.Smb = pipeline.AddSizeScaledExecutor("Smb", parameters.SmbThreads, CurrentSmbServiceModels());
+    stages.NVMe = pipeline.AddDevice(
+        "NVMe",
+        parameters.NVMeInflight,
+        LatencyDistribution(NVMeTables()[NVMeTable].second, NVMeInterpolation),
+        NVMeBandwidth);
     pipeline.AddFlushController("Flush");
+
+    return stages;
+}
+
+void AddPdiskModelKnobs(ModelControls& controls, const PdiskModelStages& stages, size_t initialNVMeTable) {
+    auto* nvme = stages.NVMe;
+
+    controls.AddProcessorCountKnob("PDisk threads", stages.PDisk);
+    AddServiceCostKnob(controls, "PDisk cost", stages.PDisk);
+    controls.AddProcessorCountKnob("Smb threads", stages.Smb);
+    AddServiceCostKnob(controls, "Smb cost", stages.Smb);
+    controls.AddProcessorCountKnob("NVMe inflight", nvme, 8);
+
+    controls.AddKnob(
+        "NVMe bandwidth",
+        [nvme] {
+            return std::to_string(nvme->GetBandwidth().GetBytesPerSecond() / MiB) + " MiB/s";
+        },
+        [nvme](int direction) {
+            constexpr size_t step = 256 * MiB;
+            auto& bandwidth = nvme->GetBandwidth();
+            auto bytesPerSecond = bandwidth.GetBytesPerSecond();
+            if (direction > 0) {
+                bandwidth.SetBytesPerSecond(bytesPerSecond + step);
+            } else if (bytesPerSecond > step) {
+                bandwidth.SetBytesPerSecond(bytesPerSecond - step);
+            }
+        });
+
+    auto tables = NVMeTables();
+    auto tableIndex = std::make_shared<size_t>(initialNVMeTable);
+    controls.AddKnob(
+        "NVMe latency table",
+        [tables, tableIndex] {
+            return std::string(tables[*tableIndex].first);
+        },
+        [nvme, tables, tableIndex](int direction) {
+            *tableIndex = (*tableIndex + tables.size() + direction) % tables.size();
+            const auto& percentiles = tables[*tableIndex].second;
+            nvme->Reconfigure([&percentiles](DeviceProcessor& processor) {
+                processor.SetPercentiles(percentiles);
+            });
+        });
+
+    AddLatencyShapeKnob(controls, "NVMe latency shape", nvme);
+}
+
+void SetupCurrentPdiskModel(ClosedPipeLine &pipeline, ModelControls& controls) {
+    auto stages = SetupPdiskModel(pipeline, PdiskModelParameters(), 0);
+    AddChunkShareKnob(controls, "Chunk I/O share", &pipeline, CurrentChunkPercent);
+    AddPdiskModelKnobs(controls, stages, 0);
+}
+
+void SetupCurrentPdiskModelSlowNVMe(ClosedPipeLine &pipeline, ModelControls& controls) {
+    auto stages = SetupPdiskModel(pipeline, PdiskModelParameters(), 1);
+    AddChunkShareKnob(controls, "Chunk I/O share", &pipeline, CurrentChunkPercent);
+    AddPdiskModelKnobs(controls, stages, 1);
 }
 
-void SetupCurrentPdiskModelSlowNVMe(ClosedPipeLine &pipeline) {
+// large chunk I/Os saturate the NVMe link before PDisk CPU
+void SetupChunkHeavyPdiskModel(ClosedPipeLine &pipeline, ModelControls& controls) {
+    auto stages = SetupPdiskModel(pipeline, PdiskModelParameters(), 0, ChunkHeavyChunkPercent);
+    AddChunkShareKnob(controls, "Chunk I/O share", &pipeline, ChunkHeavyChunkPercent);
+    AddPdiskModelKnobs(controls, stages, 0);
+}
+
+// PDisk split into workers with own queues, to estimate the cost of dispatching events between them
+void SetupMultiThreadedPdiskModel(ClosedPipeLine &pipeline, ModelControls& controls) {
     constexpr size_t startQueueSize = 32;
 
-    constexpr size_t pdiskThreads = 1;
-    constexpr double pdiskExecTime = 5 * Usec;
+    constexpr size_t pdiskWorkers = 4;
+    constexpr DispatchPolicy pdiskDispatch = DispatchPolicy::WorkStealing;
+    DispatchCosts pdiskDispatchCosts;
+    pdiskDispatchCosts.LockTime = 300 * Nsec;
+    pdiskDispatchCosts.StealTime = 1 * Usec;
 
-    constexpr size_t smbThreads = 1;
-    constexpr double smbExecTime = 2 * Usec;
+    constexpr size_t smbThreads = 2;
 
     constexpr size_t NVMeInflight = 128;
-    PercentileTimeProcessor::Percentiles diskPercentilesUs = {
-        {3.813, 12 * Usec},
-        {51.59, 25 * Usec},
-        {98.851, 50 * Usec},
-        {99.956, 100 * Usec},
-        {99.983, 200 * Usec},
-        {99.983, 200 * Usec},
-        {1000, 4000 * Usec},
-    };
+    constexpr size_t NVMeBandwidth = 3 * GiB;
+
+    pipeline.SetWorkload(Workload(PdiskWorkloadMix(CurrentChunkPercent)));
 
     pipeline.AddQueue("InputQ", startQueueSize);
-    pipeline.AddFixedTimeExecutor("PDisk", pdiskThreads, pdiskExecTime);
+    auto* pdisk = pipeline.AddMultiWorkerExecutor(
+        "PDisk", pdiskWorkers, pdiskDispatch, pdiskDispatchCosts, CurrentPdiskServiceModels());
     pipeline.AddQueue("SubmitQ", 0);
-    pipeline.AddFixedTimeExecutor("Smb", smbThreads, smbExecTime);
-    pipeline.AddPercentileTimeExecutor("NVMe", NVMeInflight, diskPercentilesUs);
+    auto* smb = pipeline.AddSizeScaledExecutor("Smb", smbThreads, CurrentSmbServiceModels());
+    auto* nvme = pipeline.AddDevice(
+        "NVMe", NVMeInflight, LatencyDistribution(CurrentNVMePercentiles(), NVMeInterpolation), NVMeBandwidth);
     pipeline.AddFlushController("Flush");
+
+    controls.AddKnob(
+        "PDisk dispatch",
+        [pdisk] {
+            return std::string(DispatchPolicyName(pdisk->GetPolicy()));
+        },
+        [pdisk](int direction) {
+            constexpr int policyCount = (int)DispatchPolicy::WorkStealing + 1;
+            int policy = ((int)pdisk->GetPolicy() + policyCount + direction) % policyCount;
+            pdisk->SetPolicy((DispatchPolicy)policy);
+        });
+    controls.AddProcessorCountKnob("Smb threads", smb);
+    AddServiceCostKnob(controls, "Smb cost", smb);
+    controls.AddProcessorCountKnob("NVMe inflight", nvme, 8);
+    AddLatencyShapeKnob(controls, "NVMe latency shape", nvme);
 }
 
-void EasyMain() {
-    ResizeScreen(1024, 768);
+// smallest configuration, which handles the target load with the slow NVMe
+void OptimizeSlowNVMeModel() {
+    OptimizerConfig config;
+    config.TargetRps = 80000;
+    config.TargetP99 = 1000 * Usec;
+    config.PDiskThreads = {1, 4};
+    config.SmbThreads = {1, 4};
+    config.NVMeInflight = {1, 128};
+
+    ConfigurationOptimizer optimizer(config, [](ClosedPipeLine& pipeline, const PdiskModelParameters& parameters) {
+        SetupPdiskModel(pipeline, parameters, 1);
+    });
 
-    ClosedPipeLine pipeline(GetEngine()->GetBackbuffer());
-    SetupCurrentPdiskModelSlowNVMe(pipeline);
+    auto frontier = optimizer.Run();
+    ConfigurationOptimizer::PrintFrontier(frontier);
+}
+
+using ModelSetup = void (*)(ClosedPipeLine&, ModelControls&);
+
+void RunInteractive(ModelSetup setup) {
+    constexpr Si32 controlsHeight = 200;
 
-    double prevTime = 0;
+    Sprite backbuffer = GetEngine()->GetBackbuffer();
+    Sprite pipelineSprite;
+    pipelineSprite.Reference(backbuffer, 0, 0, backbuffer.Width(), backbuffer.Height() - controlsHeight);
+    Sprite controlsSprite;
+    controlsSprite.Reference(backbuffer, 0, backbuffer.Height() - controlsHeight, backbuffer.Width(), controlsHeight);
 
-    double currentTime = Now();
+    ClosedPipeLine pipeline(pipelineSprite);
+    ModelControls controls(controlsSprite);
+    setup(pipeline, controls);
+
+    TimeNs prevTime = 0;
 
     for (size_t i = 0; i < 10000000000000; ++i) {
         if (IsKeyDownward(kKeyEscape)) {
@@ -84,10 +335,71 @@ void EasyMain() {
 
         auto now = Now();
         if (now - prevTime > updateScreenInterval) {
+            controls.HandleInput();
+
             Clear();
             prevTime = now;
             pipeline.Draw();
+            controls.Draw();
             ShowFrame();
         }
     }
 }
+
+// current and slow NVMe side by side, on the same events and latency draws. The models are
+// PDisk-bound, but flushes complete in order, so the slower tail costs RPS and p90/p99 latency;
+// p50 is set by the queue in front of PDisk and stays the same
+void CompareNVMeModels() {
+    ABComparison comparison(
+        GetEngine()->GetBackbuffer(),
+        {
+            {"current NVMe", [](ClosedPipeLine& pipeline) {
+                SetupPdiskModel(pipeline, PdiskModelParameters(), 0);
+            }},
+            {"slow NVMe", [](ClosedPipeLine& pipeline) {
+                SetupPdiskModel(pipeline, PdiskModelParameters(), 1);
+            }},
+        });
+
+    TimeNs prevTime = 0;
+
+    for (size_t i = 0; i < 10000000000000; ++i) {
+        if (IsKeyDownward(kKeyEscape)) {
+            break;
+        }
+        AdvanceTime(tickInterval);
+        comparison.Tick(tickInterval);
+
+        auto now = Now();
+        if (now - prevTime > updateScreenInterval) {
+            Clear();
+            prevTime = now;
+            comparison.Draw();
+            ShowFrame();
+        }
+    }
+
+    comparison.PrintReport();
+}
+
+void EasyMain() {
+    ResizeScreen(1024, 768);
+
+    switch (runMode) {
+    case RunMode::Interactive:
+        RunInteractive(SetupCurrentPdiskModelSlowNVMe);
+        break;
+    case RunMode::InteractiveChunkHeavy:
+        RunInteractive(SetupChunkHeavyPdiskModel);
+        break;
+    case RunMode::InteractiveMultiThreaded:
+        RunInteractive(SetupMultiThreadedPdiskModel);
+        break;
+    case RunMode::Optimize:
+        OptimizeSlowNVMeModel();
+        break;
+    case RunMode::Compare:
+        CompareNVMeModels();
+        break;
+    }
+}
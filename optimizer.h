@@ -0,0 +1,329 @@
+#pragma once
+
+#include <atomic>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <thread>
+
+#include "queue.h"
+
+namespace queue_sim {
+
+// ----------------------------
+// PdiskModelParameters: knobs the optimizer searches over
+
+struct PdiskModelParameters {
+    size_t PDiskThreads = 1;
+    size_t SmbThreads = 1;
+    size_t NVMeInflight = 128;
+
+    // CPU cores used by the configuration
+    size_t GetCost() const {
+        return PDiskThreads + SmbThreads;
+    }
+};
+
+using PdiskModelBuilder = std::function<void(ClosedPipeLine&, const PdiskModelParameters&)>;
+
+// ----------------------------
+// OptimizerConfig
+
+struct OptimizerConfig {
+    struct Bounds {
+        size_t Min = 1;
+        size_t Max = 1;
+    };
+
+    double TargetRps = 0;
+    TimeNs TargetP99 = 0;
+
+    Bounds PDiskThreads;
+    Bounds SmbThreads;
+    Bounds NVMeInflight;
+
+    TimeNs TickInterval = 1 * Usec;
+    TimeNs WarmupTime = 10 * Msec;
+
+    // simulated time of a single bisection probe, each racing round doubles it
+    TimeNs ProbeTime = 50 * Msec;
+    size_t RaceRounds = 3;
+
+    // in early racing rounds candidates are dropped only when they miss the targets
+    // (or lose to another candidate) by more than this share, to tolerate noise
+    double RaceMargin = 0.05;
+
+    size_t Threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // all candidates see the same events and latency draws, so that they are compared
+    // on the same workload rather than on different noise
+    uint64_t Seed = RandomSeed();
+};
+
+// ----------------------------
+// ConfigurationOptimizer: looks for the cheapest configurations, which reach the target
+// throughput with the target p99 latency.
+//
+// Throughput is monotone in all the knobs, so they are bisected rather than enumerated: for
+// each PDisk threads count the smallest Smb threads count meeting both targets at the max
+// inflight is found, then the smallest NVMe inflight for that pair. Pairs with more Smb
+// threads only cost more and are not simulated. Then candidates are raced:
+// each round simulates all survivors longer and drops the ones, which miss the targets
+// or are dominated by a cheaper candidate with lower latency. Simulations run concurrently,
+// one per thread.
+
+class ConfigurationOptimizer {
+public:
+    struct Result {
+        PdiskModelParameters Parameters;
+        double Rps = 0;
+        TimeNs P99 = 0;
+    };
+
+    using Results = std::vector<Result>;
+
+    ConfigurationOptimizer(OptimizerConfig config, PdiskModelBuilder builder)
+        : Config(std::move(config))
+        , Builder(std::move(builder))
+    {
+        if (Config.PDiskThreads.Min == 0 || Config.SmbThreads.Min == 0 || Config.NVMeInflight.Min == 0) {
+            throw std::runtime_error("Parameter bounds must be positive");
+        }
+        if (Config.PDiskThreads.Min > Config.PDiskThreads.Max
+                || Config.SmbThreads.Min > Config.SmbThreads.Max
+                || Config.NVMeInflight.Min > Config.NVMeInflight.Max) {
+            throw std::runtime_error("Parameter bounds must be ordered");
+        }
+    }
+
+    // returns Pareto frontier of cost versus p99 latency, sorted by cost
+    Results Run() {
+        std::vector<size_t> pdiskThreads;
+        for (size_t pdisk = Config.PDiskThreads.Min; pdisk <= Config.PDiskThreads.Max; ++pdisk) {
+            pdiskThreads.push_back(pdisk);
+        }
+
+        std::printf("optimizer: bisecting Smb threads and NVMe inflight for %ld PDisk thread counts\n",
+            pdiskThreads.size());
+
+        std::vector<std::optional<Result>> bisected(pdiskThreads.size());
+        ParallelFor(pdiskThreads.size(), [&](size_t i) {
+            if (auto atMaxInflight = BisectSmbThreads(pdiskThreads[i])) {
+                bisected[i] = BisectInflight(*atMaxInflight);
+            }
+        });
+
+        Results candidates;
+        for (auto& result: bisected) {
+            if (result) {
+                candidates.push_back(*result);
+            }
+        }
+
+        TimeNs duration = Config.ProbeTime;
+        for (size_t round = 0; round < Config.RaceRounds && !candidates.empty(); ++round) {
+            duration *= 2;
+            bool isLastRound = round + 1 == Config.RaceRounds;
+            double margin = isLastRound ? 0 : Config.RaceMargin;
+
+            ParallelFor(candidates.size(), [&](size_t i) {
+                candidates[i] = Evaluate(candidates[i].Parameters, duration);
+            });
+
+            candidates = DropLosers(candidates, margin);
+            std::printf("optimizer: racing round %ld (%.2f s simulated), %ld candidates left\n",
+                round + 1, ToSeconds(duration), candidates.size());
+        }
+
+        return ParetoFrontier(candidates);
+    }
+
+    static void PrintFrontier(const Results& frontier) {
+        if (frontier.empty()) {
+            std::printf("no configuration within the bounds reaches the targets\n");
+            return;
+        }
+
+        std::printf("%8s %8s %8s %8s %10s %10s\n", "cost", "pdisk", "smb", "inflight", "RPS", "p99 us");
+        for (const auto& result: frontier) {
+            std::printf("%8ld %8ld %8ld %8ld %10.0f %10ld\n",
+                result.Parameters.GetCost(),
+                result.Parameters.PDiskThreads,
+                result.Parameters.SmbThreads,
+                result.Parameters.NVMeInflight,
+                result.Rps,
+                result.P99 / Usec);
+        }
+    }
+
+private:
+    Result Evaluate(const PdiskModelParameters& parameters, TimeNs duration) const {
+        ClosedPipeLine pipeline(Sprite(), Config.Seed);
+        pipeline.EnableBatchStats();
+        Builder(pipeline, parameters);
+
+        auto tick = [&](TimeNs time) {
+            for (TimeNs passed = 0; passed < time; passed += Config.TickInterval) {
+                AdvanceTime(Config.TickInterval);
+                pipeline.Tick(Config.TickInterval);
+            }
+        };
+
+        // the whole run is a single batch, its p99 is exact rather than the upper edge
+        // of a histogram bucket, which would make close candidates tie
+        tick(Config.WarmupTime);
+        pipeline.TakeBatchStats();
+        tick(duration);
+        auto stats = pipeline.TakeBatchStats();
+
+        Result result;
+        result.Parameters = parameters;
+        result.Rps = stats.Rps;
+        result.P99 = stats.P99;
+        return result;
+    }
+
+    bool MeetsTargets(const Result& result, double margin) const {
+        return result.Rps >= Config.TargetRps * (1 - margin)
+            && result.P99 <= Config.TargetP99 * (1 + margin);
+    }
+
+    // smallest Smb threads count meeting both targets at the max inflight, nothing when
+    // even the max count doesn't
+    std::optional<Result> BisectSmbThreads(size_t pdiskThreads) const {
+        PdiskModelParameters parameters;
+        parameters.PDiskThreads = pdiskThreads;
+        parameters.SmbThreads = Config.SmbThreads.Max;
+        parameters.NVMeInflight = Config.NVMeInflight.Max;
+
+        auto best = Evaluate(parameters, Config.ProbeTime);
+        if (!MeetsTargets(best, 0)) {
+            return std::nullopt;
+        }
+
+        size_t lo = Config.SmbThreads.Min;
+        size_t hi = Config.SmbThreads.Max;
+        while (lo < hi) {
+            parameters.SmbThreads = lo + (hi - lo) / 2;
+            auto result = Evaluate(parameters, Config.ProbeTime);
+            if (MeetsTargets(result, 0)) {
+                hi = parameters.SmbThreads;
+                best = result;
+            } else {
+                lo = parameters.SmbThreads + 1;
+            }
+        }
+
+        return best;
+    }
+
+    // smallest inflight meeting both targets, starting from the result at the max one. Small
+    // inflight might reach the RPS target with p99 above the target, so both are checked
+    Result BisectInflight(const Result& atMaxInflight) const {
+        auto parameters = atMaxInflight.Parameters;
+        auto best = atMaxInflight;
+
+        size_t lo = Config.NVMeInflight.Min;
+        size_t hi = Config.NVMeInflight.Max;
+        while (lo < hi) {
+            parameters.NVMeInflight = lo + (hi - lo) / 2;
+            auto result = Evaluate(parameters, Config.ProbeTime);
+            if (MeetsTargets(result, 0)) {
+                hi = parameters.NVMeInflight;
+                best = result;
+            } else {
+                lo = parameters.NVMeInflight + 1;
+            }
+        }
+
+        return best;
+    }
+
+    // drops candidates missing the targets and the ones, which a cheaper feasible candidate
+    // matches or beats in latency
+    Results DropLosers(const Results& candidates, double margin) const {
+        Results feasible;
+        for (const auto& candidate: candidates) {
+            if (MeetsTargets(candidate, margin)) {
+                feasible.push_back(candidate);
+            }
+        }
+
+        Results survivors;
+        for (const auto& candidate: feasible) {
+            bool dominated = false;
+            for (const auto& other: feasible) {
+                if (other.Parameters.GetCost() < candidate.Parameters.GetCost()
+                        && other.P99 * (1 + margin) <= candidate.P99) {
+                    dominated = true;
+                    break;
+                }
+            }
+
+            if (!dominated) {
+                survivors.push_back(candidate);
+            }
+        }
+
+        return survivors;
+    }
+
+    static Results ParetoFrontier(Results candidates) {
+        std::sort(candidates.begin(), candidates.end(), [](const Result& lhs, const Result& rhs) {
+            if (lhs.Parameters.GetCost() != rhs.Parameters.GetCost()) {
+                return lhs.Parameters.GetCost() < rhs.Parameters.GetCost();
+            }
+            if (lhs.P99 != rhs.P99) {
+                return lhs.P99 < rhs.P99;
+            }
+            return lhs.Parameters.NVMeInflight < rhs.Parameters.NVMeInflight;
+        });
+
+        // with candidates sorted by cost, a candidate is on the frontier when it has
+        // lower latency than all cheaper ones
+        Results frontier;
+        for (const auto& candidate: candidates) {
+            if (frontier.empty() || candidate.P99 < frontier.back().P99) {
+                frontier.push_back(candidate);
+            }
+        }
+
+        return frontier;
+    }
+
+    template <typename Func>
+    void ParallelFor(size_t count, Func&& func) const {
+        std::atomic<size_t> next(0);
+        std::exception_ptr error;
+        std::mutex errorMutex;
+
+        auto worker = [&] {
+            for (size_t i = next++; i < count; i = next++) {
+                try {
+                    func(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> guard(errorMutex);
+                    error = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < std::min(Config.Threads, count); ++i) {
+            threads.emplace_back(worker);
+        }
+        for (auto& thread: threads) {
+            thread.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    OptimizerConfig Config;
+    PdiskModelBuilder Builder;
+};
+
+} // namespace queue_sim
@@ -1,7 +1,11 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <deque>
+#include <functional>
 #include <optional>
 #include <random>
 #include <set>
@@ -14,23 +18,38 @@ namespace queue_sim {
 
 using namespace arctic;  // NOLINT
 
-static constexpr double Usec = 0.000001;
-static constexpr double Msec = 0.001;
+// simulated time is an integer number of nanoseconds: it is advanced by exact
+// increments, so long runs don't accumulate rounding error
+using TimeNs = int64_t;
+
+static constexpr TimeNs Nsec = 1;
+static constexpr TimeNs Usec = 1000 * Nsec;
+static constexpr TimeNs Msec = 1000 * Usec;
+static constexpr TimeNs Sec = 1000 * Msec;
+
+static constexpr size_t KiB = 1024;
+static constexpr size_t MiB = 1024 * KiB;
+static constexpr size_t GiB = 1024 * MiB;
+
+double ToSeconds(TimeNs t) {
+    return (double)t / Sec;
+}
 
 // TODO: move definitions to own cpp file
 
 // ----------------------------
 // our global time
 //
+// each thread runs own simulations, so the clock is per thread
 
-static double CurrentTimeSeconds = 0;
+static thread_local TimeNs CurrentTimeNs = 0;
 
-double Now() {
-    return CurrentTimeSeconds;
+TimeNs Now() {
+    return CurrentTimeNs;
 }
 
-void AdvanceTime(double dt) {
-    CurrentTimeSeconds += dt;
+void AdvanceTime(TimeNs dt) {
+    CurrentTimeNs += dt;
 }
 
 // ----------------------------
@@ -59,16 +78,51 @@ std::string NumToStrWithSuffix(size_t num) {
     }
 }
 
+// ----------------------------
+// random draws
+//
+// events carry own seed and every stage derives its draws from the seed and its stream,
+// so that pipeline variants started with the same seed see the same draws
+// (common random numbers), no matter how their stages are ordered or timed
+
+// SplitMix64 finalizer
+uint64_t MixBits(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// uniform in [0, 1)
+double UniformFromSeed(uint64_t seed, uint64_t stream) {
+    return (MixBits(seed ^ MixBits(stream)) >> 11) * 0x1.0p-53;
+}
+
+// FNV-1a, stages use their names as streams
+constexpr uint64_t StreamFromName(const char* name) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name; ++name) {
+        hash = (hash ^ (unsigned char)*name) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t RandomSeed() {
+    std::random_device rd;
+    return ((uint64_t)rd() << 32) | rd();
+}
+
 // ----------------------------
 // Histogram
 
+// bucket thresholds and recorded durations are in nanoseconds
 class Histogram {
 private:
-    std::vector<int> Buckets;
-    std::vector<int> Counts;
+    std::vector<TimeNs> Buckets;
+    std::vector<size_t> Counts;
 
 public:
-    Histogram(const std::vector<int>& bucketThresholds)
+    Histogram(const std::vector<TimeNs>& bucketThresholds)
         : Buckets(bucketThresholds)
         , Counts(bucketThresholds.size() + 1, 0)
     {
@@ -80,7 +134,7 @@ public:
     }
 
     static Histogram HistogramWithUsBuckets() {
-        return Histogram(
+        std::vector<TimeNs> bucketsUs =
             { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10,
               16, 24, 32, 40, 48, 50, 54, 62, 70,
               80, 90, 100, 110, 120, 130, 140, 150, 160, 170, 180, 190, 200,
@@ -90,31 +144,34 @@ public:
               24000, 32000, 40000, 48000, 56000, 64000,
               128000, 256000, 512000,
               1000000, 1500000, 2000000, 3000000, 4000000
-            });
-    }
+            };
 
-    void AddDuration(int duration) {
-        for (size_t i = 0; i < Buckets.size(); ++i) {
-            if (duration < Buckets[i]) {
-                ++Counts[i];
-                return;
-            }
+        for (auto& bucket: bucketsUs) {
+            bucket *= Usec;
         }
-        ++Counts.back();
+
+        return Histogram(bucketsUs);
     }
 
-    int GetPercentile(int percentile) {
+    void AddDuration(TimeNs duration) {
+        // index of the first bucket with threshold > duration, Counts.back() when none
+        auto it = std::upper_bound(Buckets.begin(), Buckets.end(), duration);
+        ++Counts[it - Buckets.begin()];
+    }
+
+    // returns bucket threshold in ns
+    TimeNs GetPercentile(int percentile) {
         if (percentile < 0 || percentile > 100) {
             throw std::runtime_error("Percentile must be between 0 and 100.");
         }
 
-        int totalCounts = 0;
-        for (int count : Counts) {
+        size_t totalCounts = 0;
+        for (size_t count : Counts) {
             totalCounts += count;
         }
 
-        int threshold = (int)((percentile / 100.0) * totalCounts);
-        int cumulativeCount = 0;
+        size_t threshold = (size_t)((percentile / 100.0) * totalCounts);
+        size_t cumulativeCount = 0;
 
         for (size_t i = 0; i < Counts.size(); ++i) {
             cumulativeCount += Counts[i];
@@ -127,13 +184,43 @@ public:
     }
 };
 
+// ----------------------------
+// EventType
+
+enum class EventType {
+    LogWrite = 0,
+    ChunkWrite,
+    ChunkRead,
+    Flush,
+};
+
+static constexpr size_t EventTypeCount = (size_t)EventType::Flush + 1;
+
+const char* EventTypeName(EventType type) {
+    switch (type) {
+    case EventType::LogWrite:
+        return "LogWrite";
+    case EventType::ChunkWrite:
+        return "ChunkWrite";
+    case EventType::ChunkRead:
+        return "ChunkRead";
+    case EventType::Flush:
+        return "Flush";
+    }
+
+    return "Unknown";
+}
+
 // ----------------------------
 // Event
 
 struct Event {
 private:
-    Event()
-        : Id(++EventCounter)
+    Event(size_t id, uint64_t seed, EventType type, size_t size)
+        : Id(id)
+        , Seed(seed)
+        , Type(type)
+        , Size(size)
         , StartTime(Now())
     {
     }
@@ -141,19 +228,20 @@ private:
 public:
     Event(const Event& other) = default;
 
-    static Event NewEvent() {
-        return Event();
+    // ids must be sequential within a pipeline, see FlushController
+    static Event NewEvent(size_t id, uint64_t seed, EventType type = EventType::LogWrite, size_t size = 0) {
+        return Event(id, seed, type, size);
     }
 
     bool operator<(const Event& other) const {
         return Id < other.Id;
     }
 
-    double GetDuration() const {
+    TimeNs GetDuration() const {
         return Now() - StartTime;
     }
 
-    double GetStageDuration() const {
+    TimeNs GetStageDuration() const {
         return Now() - StageStarted;
     }
 
@@ -165,16 +253,82 @@ public:
         return Id;
     }
 
+    EventType GetType() const {
+        return Type;
+    }
+
+    // payload size in bytes
+    size_t GetSize() const {
+        return Size;
+    }
+
+    // uniform in [0, 1), the same for the same event and stream
+    double GetUniform(uint64_t stream) const {
+        return UniformFromSeed(Seed, stream);
+    }
+
 private:
     size_t Id;
+    uint64_t Seed;
+    EventType Type;
+    size_t Size;
 
-    double StartTime = 0;
-    double StageStarted = 0;
-
-    static size_t EventCounter;
+    TimeNs StartTime = 0;
+    TimeNs StageStarted = 0;
 };
 
-size_t Event::EventCounter = 0;
+// ----------------------------
+// Workload: weighted mix of request classes, which the closed pipeline generates
+
+class Workload {
+public:
+    struct Item {
+        EventType Type = EventType::LogWrite;
+        size_t Size = 0;
+        double Weight = 1;
+    };
+
+    using Items = std::vector<Item>;
+
+    Workload(Items items)
+        : _Items(std::move(items))
+    {
+        if (_Items.empty()) {
+            throw std::runtime_error("Workload must not be empty");
+        }
+
+        double total = 0;
+        for (const auto& item: _Items) {
+            if (item.Weight < 0) {
+                throw std::runtime_error("Workload weights must not be negative");
+            }
+            total += item.Weight;
+            CumulativeWeights.push_back(total);
+        }
+
+        if (total <= 0) {
+            throw std::runtime_error("Workload weights must not be all zero");
+        }
+    }
+
+    static Workload SingleClass(EventType type, size_t size) {
+        return Workload({{type, size, 1}});
+    }
+
+    // the class is drawn from the event seed
+    Event NewEvent(size_t id, uint64_t seed) const {
+        double r = UniformFromSeed(seed, RandomStream) * CumulativeWeights.back();
+        auto it = std::upper_bound(CumulativeWeights.begin(), CumulativeWeights.end(), r);
+        const auto& item = _Items[std::min<size_t>(it - CumulativeWeights.begin(), _Items.size() - 1)];
+        return Event::NewEvent(id, seed, item.Type, item.Size);
+    }
+
+private:
+    static constexpr uint64_t RandomStream = StreamFromName("Workload");
+
+    Items _Items;
+    std::vector<double> CumulativeWeights;
+};
 
 // ----------------------------
 // IPipeLineItem
@@ -183,7 +337,7 @@ class IPipeLineItem {
 public:
     virtual ~IPipeLineItem() = default;
 
-    virtual void Tick(double dt) = 0;
+    virtual void Tick(TimeNs dt) = 0;
 
     virtual bool IsReadyToPushEvent() const = 0;
     virtual void PushEvent(Event event) = 0;
@@ -202,16 +356,13 @@ using PipeLineItemPtr = std::unique_ptr<IPipeLineItem>;
 
 class Queue : public IPipeLineItem {
 public:
-    Queue(const char* name, size_t initialEvents = 0)
+    Queue(const char* name)
         : Name(name)
         , QueueTimeUs(Histogram::HistogramWithUsBuckets())
     {
-        for (size_t i = 0; i < initialEvents; ++i) {
-            PushEvent(Event::NewEvent());
-        }
     }
 
-    void Tick(double dt) override {
+    void Tick(TimeNs dt) override {
         /* do nothing */
     }
 
@@ -231,7 +382,7 @@ public:
 
     Event PopEvent() override {
         Event event = Events.front();
-        QueueTimeUs.AddDuration((int)(event.GetStageDuration() * 1000000));
+        QueueTimeUs.AddDuration(event.GetStageDuration());
 
         Events.pop_front();
         return event;
@@ -257,8 +408,8 @@ public:
         char text[128];
         auto queueLengthS = NumToStrWithSuffix(Events.size());
 
-        snprintf(text, sizeof(text), "%s: %s\np90: %d us",
-                 Name, queueLengthS.c_str(), QueueTimeUs.GetPercentile(90));
+        snprintf(text, sizeof(text), "%s: %s\np90: %ld us",
+                 Name, queueLengthS.c_str(), QueueTimeUs.GetPercentile(90) / Usec);
         GetFont().Draw(toSprite, text, 10, yPos + rHeight / 2 - 20);
     }
 
@@ -273,7 +424,7 @@ private:
 
 class ProcessorBase {
 public:
-    virtual void Tick(double dt) = 0;
+    virtual void Tick(TimeNs dt) = 0;
 
     virtual void StartWork(Event event) {
         _Event = event;
@@ -313,8 +464,8 @@ protected:
     bool _IsWorking = false; // might be false, but with event, when ready to pop
     bool _IsEventReady = false;
 
-    double StartTime = 0;
-    double FinishTime = 0;
+    TimeNs StartTime = 0;
+    TimeNs FinishTime = 0;
 
     std::optional<Event> _Event;
 };
@@ -324,12 +475,26 @@ protected:
 
 class FixedTimeProcessor : public ProcessorBase {
 public:
-    FixedTimeProcessor(double executionTime)
+    FixedTimeProcessor(TimeNs executionTime)
         : ExecutionTime(executionTime)
     {
     }
 
-    void Tick(double) override {
+    // idle processor with the same parameters
+    FixedTimeProcessor Clone() const {
+        return FixedTimeProcessor(ExecutionTime);
+    }
+
+    TimeNs GetExecutionTime() const {
+        return ExecutionTime;
+    }
+
+    // applies to the current work as well
+    void SetExecutionTime(TimeNs executionTime) {
+        ExecutionTime = executionTime;
+    }
+
+    void Tick(TimeNs) override {
         if (_IsWorking) {
             auto now = Now();
             if (now - StartTime >= ExecutionTime) {
@@ -340,256 +505,1163 @@ public:
         }
     }
 private:
-    double ExecutionTime;
+    TimeNs ExecutionTime;
 };
 
 // ----------------------------
-// PercentileTimeProcessor
+// LatencyDistribution: latency given by a percentile table, sampled via its inverse CDF.
+// Between the table points the distribution is either a step function, interpolated,
+// or a parametric fit of the same points. Sampling cost doesn't depend on the mode.
+
+enum class LatencyInterpolation {
+    Step,       // all values of the band are equal to its upper point
+    Linear,     // piecewise-linear between the points
+    LogLinear,  // piecewise-linear in log(latency) between the points
+    LogNormal,  // log-normal fitted to the points
+    ParetoTail, // log-linear body, Pareto tail fitted to the points above the tail percentile
+};
 
-class PercentileTimeProcessor : public ProcessorBase {
+const char* LatencyInterpolationName(LatencyInterpolation interpolation) {
+    switch (interpolation) {
+    case LatencyInterpolation::Step:
+        return "step";
+    case LatencyInterpolation::Linear:
+        return "linear";
+    case LatencyInterpolation::LogLinear:
+        return "log-linear";
+    case LatencyInterpolation::LogNormal:
+        return "log-normal";
+    case LatencyInterpolation::ParetoTail:
+        return "pareto tail";
+    }
+
+    return "unknown";
+}
+
+class LatencyDistribution {
 public:
     struct Percentile {
         double Percentile = 0;
-        double Value = 0;
+        TimeNs Value = 0;
     };
 
+    // sorted, percentiles above 100 are treated as 100. The last value is the max latency,
+    // samples of the parametric fits are capped by it
     using Percentiles = std::vector<Percentile>;
 
-    PercentileTimeProcessor(Percentiles percentiles)
+    LatencyDistribution(
+            Percentiles percentiles,
+            LatencyInterpolation interpolation = LatencyInterpolation::Step,
+            double tailPercentile = 99)
         : _Percentiles(std::move(percentiles))
-        , Rd(std::make_unique<std::random_device>())
-        , Gen(std::make_unique<std::mt19937>((*Rd)()))
-        , Dis(std::make_unique<std::uniform_real_distribution<>>(0, 100))
+        , Interpolation(interpolation)
+        , TailPercentile(tailPercentile)
     {
         if (_Percentiles.empty()) {
             throw std::runtime_error("Percentiles must not be empty");
         }
-    }
-
-    PercentileTimeProcessor(const PercentileTimeProcessor& other) = delete;
-    PercentileTimeProcessor(PercentileTimeProcessor&& other) = default;
 
-    void StartWork(Event event) override {
-        ProcessorBase::StartWork(event);
-
-        double r = (*Dis)(*Gen);
-        for (auto& percentile: _Percentiles) {
-            if (r < percentile.Percentile) {
-                ExecutionTime = percentile.Value;
-                return;
+        for (size_t i = 1; i < _Percentiles.size(); ++i) {
+            if (_Percentiles[i].Percentile < _Percentiles[i - 1].Percentile
+                    || _Percentiles[i].Value < _Percentiles[i - 1].Value) {
+                throw std::runtime_error("Percentiles must be sorted");
             }
         }
 
-        ExecutionTime = _Percentiles.back().Value;
+        Fit();
     }
 
-    void Tick(double) override {
-        if (_IsWorking) {
-            auto now = Now();
-            if (now - StartTime >= ExecutionTime) {
-                _IsWorking = false;
-                _IsEventReady = true;
-                FinishTime = now;
+    const Percentiles& GetPercentiles() const {
+        return _Percentiles;
+    }
+
+    LatencyInterpolation GetInterpolation() const {
+        return Interpolation;
+    }
+
+    double GetTailPercentile() const {
+        return TailPercentile;
+    }
+
+    // percentile is uniform in [0, 100)
+    TimeNs Sample(double percentile) const {
+        switch (Interpolation) {
+        case LatencyInterpolation::Step:
+            for (auto& point: _Percentiles) {
+                if (percentile < point.Percentile) {
+                    return point.Value;
+                }
+            }
+            return _Percentiles.back().Value;
+        case LatencyInterpolation::Linear:
+        case LatencyInterpolation::LogLinear:
+            return SamplePiecewise(percentile);
+        case LatencyInterpolation::LogNormal: {
+            double p = std::min(std::max(percentile / 100, MinProbability), 1 - MinProbability);
+            return Cap(std::exp(Mu + Sigma * InverseNormalCdf(p)));
+        }
+        case LatencyInterpolation::ParetoTail:
+            if (percentile <= TailStart.Percentile) {
+                return SamplePiecewise(percentile);
+            } else {
+                double tailShare = (100 - TailStart.Percentile) / std::max(100 - percentile, MinProbability);
+                return Cap(TailStart.Value * std::pow(tailShare, 1 / Alpha));
             }
         }
+
+        return _Percentiles.back().Value;
     }
 
 private:
-    Percentiles _Percentiles;
-    std::unique_ptr<std::random_device> Rd;
-    std::unique_ptr<std::mt19937> Gen;
-    std::unique_ptr<std::uniform_real_distribution<>> Dis;
-
-    double ExecutionTime;
-};
-
-// ----------------------------
-// Executor
+    static constexpr double MinProbability = 1e-12;
+
+    void Fit() {
+        // distinct points with percentiles clamped to 100
+        Points.clear();
+        for (auto point: _Percentiles) {
+            point.Percentile = std::min(point.Percentile, 100.0);
+            if (Points.empty() || point.Percentile > Points.back().Percentile) {
+                Points.push_back(point);
+            }
+        }
 
-template <typename ProcessorType>
-class Executor : public IPipeLineItem {
-public:
+        // below the first point the first segment is extrapolated down to the 0 percentile
+        LowestValue = (double)Points.front().Value;
+        if (Points.size() > 1 && Points.front().Percentile > 0) {
+            const auto& p0 = Points[0];
+            const auto& p1 = Points[1];
+            double t = -p0.Percentile / (p1.Percentile - p0.Percentile);
+            LowestValue = Interpolate(p0.Value, p1.Value, t);
+        }
 
-    template<typename... Args>
-    Executor(const char* name, size_t processorCount, Args&&... args)
-        : Name(name)
-        , BusyProcessorCount(0)
-    {
-        for (size_t i = 0; i < processorCount; ++i) {
-            Processors.emplace_back(std::forward<Args>(args)...);
+        if (Interpolation == LatencyInterpolation::LogNormal) {
+            FitLogNormal();
+        } else if (Interpolation == LatencyInterpolation::ParetoTail) {
+            FitParetoTail();
         }
     }
 
-    void Tick(double dt) override {
-        BusyProcessorCount = 0;
-        ReadyEventsCount = 0;
-
-        for (auto& processor: Processors) {
-            processor.Tick(dt);
-            if (processor.IsBusy()) {
-                ++BusyProcessorCount;
-            }
-            if (processor.IsEventReady()) {
-                ++ReadyEventsCount;
+    // least squares fit of log(value) = Mu + Sigma * z(percentile)
+    void FitLogNormal() {
+        std::vector<std::pair<double, double>> zy;
+        for (const auto& point: Points) {
+            if (point.Percentile > 0 && point.Percentile < 100 && point.Value > 0) {
+                zy.emplace_back(InverseNormalCdf(point.Percentile / 100), std::log((double)point.Value));
             }
         }
-    }
 
-    bool IsReadyToPushEvent() const override {
-        return BusyProcessorCount < Processors.size();
-    }
+        if (zy.size() < 2) {
+            throw std::runtime_error("Log-normal fit needs at least 2 points between 0 and 100 percentiles");
+        }
 
-    void PushEvent(Event event) override {
-        if (!IsReadyToPushEvent()) {
-            throw std::runtime_error("Executor is full");
+        double zMean = 0;
+        double yMean = 0;
+        for (const auto& [z, y]: zy) {
+            zMean += z;
+            yMean += y;
+        }
+        zMean /= zy.size();
+        yMean /= zy.size();
+
+        double covariance = 0;
+        double variance = 0;
+        for (const auto& [z, y]: zy) {
+            covariance += (z - zMean) * (y - yMean);
+            variance += (z - zMean) * (z - zMean);
         }
 
-        event.StartStage();
+        Sigma = covariance / variance;
+        Mu = yMean - Sigma * zMean;
+    }
 
-        for (auto& processor: Processors) {
-            if (!processor.IsBusy()) {
-                processor.StartWork(event);
-                if (processor.IsBusy()) {
-                    ++BusyProcessorCount;
-                }
-                return;
+    // tail starts at the last point not above TailPercentile, its shape is fitted as
+    // P(X > x) = P(X > start) * (start / x) ^ Alpha by least squares through the start point
+    void FitParetoTail() {
+        size_t startIndex = 0;
+        for (size_t i = 0; i < Points.size(); ++i) {
+            if (Points[i].Percentile <= TailPercentile) {
+                startIndex = i;
             }
         }
-    }
-
-    bool IsReadyToPopEvent() const override {
-        return ReadyEventsCount > 0;
-    }
+        TailStart = Points[startIndex];
+
+        double ab = 0;
+        double bb = 0;
+        for (size_t i = startIndex + 1; i < Points.size(); ++i) {
+            const auto& point = Points[i];
+            if (point.Percentile >= 100 || point.Value <= TailStart.Value) {
+                continue;
+            }
+            double a = std::log((100 - TailStart.Percentile) / (100 - point.Percentile));
+            double b = std::log((double)point.Value / TailStart.Value);
+            ab += a * b;
+            bb += b * b;
+        }
 
-    Event PopEvent() override {
-        if (!IsReadyToPopEvent()) {
-            throw std::runtime_error("No events ready");
+        if (bb == 0 || ab <= 0) {
+            throw std::runtime_error("Pareto tail needs points above the tail percentile");
         }
 
-        for (auto& processor: Processors) {
-            if (processor.IsEventReady()) {
-                --ReadyEventsCount;
-                --BusyProcessorCount;
-                return processor.PopEvent();
+        Alpha = ab / bb;
+    }
+
+    TimeNs SamplePiecewise(double percentile) const {
+        double prevPercentile = 0;
+        double prevValue = LowestValue;
+        for (const auto& point: Points) {
+            if (percentile < point.Percentile) {
+                double t = (percentile - prevPercentile) / (point.Percentile - prevPercentile);
+                return (TimeNs)std::llround(Interpolate(prevValue, point.Value, t));
             }
+            prevPercentile = point.Percentile;
+            prevValue = point.Value;
         }
 
-        throw std::runtime_error("No events ready");
+        return Points.back().Value;
     }
 
-    size_t GetProcessorCount() const {
-        return Processors.size();
+    // t is 0 at lhs, 1 at rhs, might be outside [0, 1] for extrapolation
+    double Interpolate(double lhs, double rhs, double t) const {
+        if (Interpolation == LatencyInterpolation::Linear || lhs <= 0 || rhs <= 0) {
+            return std::max(0.0, lhs + (rhs - lhs) * t);
+        }
+        return lhs * std::pow(rhs / lhs, t);
     }
 
-    size_t GetBusyProcessorCount() const {
-        return BusyProcessorCount;
+    TimeNs Cap(double value) const {
+        return (TimeNs)std::llround(std::min(value, (double)_Percentiles.back().Value));
     }
 
-public:
-    void Draw(Sprite toSprite) override {
-        auto width = toSprite.Width();
-        auto height = toSprite.Height();
-
-        auto minDimension = std::min(width, height);
-        auto yPos = height / 2 - minDimension / 2;
-
-        Vec2Si32 bottomLeft(0, yPos);
-        Vec2Si32 topRight(minDimension, yPos + minDimension);
+    // Acklam's rational approximation, relative error below 1.2e-9
+    static double InverseNormalCdf(double p) {
+        static constexpr double a[] = {
+            -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+            1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00};
+        static constexpr double b[] = {
+            -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+            6.680131188771972e+01, -1.328068155288572e+01};
+        static constexpr double c[] = {
+            -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+            -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00};
+        static constexpr double d[] = {
+            7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+            3.754408661907416e+00};
+        static constexpr double pLow = 0.02425;
+
+        if (p < pLow) {
+            double q = std::sqrt(-2 * std::log(p));
+            return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5])
+                / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+        }
 
-        DrawRectangle(toSprite, bottomLeft, topRight, Rgba(255, 255, 255, 255));
+        if (p > 1 - pLow) {
+            double q = std::sqrt(-2 * std::log(1 - p));
+            return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5])
+                / ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+        }
 
-        char text[128];
-        snprintf(text, sizeof(text), "%s:\n%ld/%ld", Name, BusyProcessorCount, Processors.size());
-        GetFont().Draw(toSprite, text, 10, yPos + minDimension / 2);
+        double q = p - 0.5;
+        double r = q * q;
+        return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q
+            / (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
     }
 
 private:
-    const char* Name;
+    Percentiles _Percentiles;
+    LatencyInterpolation Interpolation;
+    double TailPercentile;
 
-    std::vector<ProcessorType> Processors;
-    size_t BusyProcessorCount = 0;
-    size_t ReadyEventsCount = 0;
+    Percentiles Points;
+    double LowestValue = 0;
+
+    double Mu = 0;
+    double Sigma = 0;
+
+    Percentile TailStart;
+    double Alpha = 0;
 };
 
 // ----------------------------
-// FlushController: events should wait all previous events to finish
+// PercentileTimeProcessor
 
-class FlushController : public IPipeLineItem {
+class PercentileTimeProcessor : public ProcessorBase {
 public:
-    FlushController(const char* name)
-        : Name(name)
-        , WaitingTimeUs(Histogram::HistogramWithUsBuckets())
+    using Percentile = LatencyDistribution::Percentile;
+    using Percentiles = LatencyDistribution::Percentiles;
+
+    // latency of the event is drawn from its seed and the randomStream, usually the stage name
+    PercentileTimeProcessor(LatencyDistribution distribution, uint64_t randomStream = 0)
+        : Distribution(std::move(distribution))
+        , RandomStream(randomStream)
     {
     }
 
-    void Tick(double) override {
-        /* do nothing */
+    // idle processor with the same parameters
+    PercentileTimeProcessor Clone() const {
+        return PercentileTimeProcessor(Distribution, RandomStream);
     }
 
-    bool IsReadyToPushEvent() const override {
-        return true;
+    const LatencyDistribution& GetDistribution() const {
+        return Distribution;
     }
 
-    void PushEvent(Event event) override {
-        event.StartStage();
-        WaitingEvents.insert(event);
+    // applies starting from the next event
+    void SetDistribution(LatencyDistribution distribution) {
+        Distribution = std::move(distribution);
     }
 
-    bool IsReadyToPopEvent() const override {
-        if (WaitingEvents.empty()) {
-            return false;
-        }
-
-        size_t lowestId = WaitingEvents.begin()->GetId();
-        return lowestId - 1 == FinishedEventsBarrier;
+    // keeps the interpolation
+    void SetPercentiles(Percentiles percentiles) {
+        Distribution = LatencyDistribution(
+            std::move(percentiles), Distribution.GetInterpolation(), Distribution.GetTailPercentile());
     }
 
-    Event PopEvent() override {
-        if (!IsReadyToPopEvent()) {
-            throw std::runtime_error("No events ready");
-        }
+    // keeps the percentiles
+    void SetInterpolation(LatencyInterpolation interpolation) {
+        Distribution = LatencyDistribution(
+            Distribution.GetPercentiles(), interpolation, Distribution.GetTailPercentile());
+    }
 
-        auto iter = WaitingEvents.begin();
-        auto event = *iter;
-        WaitingEvents.erase(iter);
+    void StartWork(Event event) override {
+        ProcessorBase::StartWork(event);
+        ExecutionTime = Distribution.Sample(event.GetUniform(RandomStream) * 100);
+    }
 
-        if (event.GetId() - 1 != FinishedEventsBarrier) {
-            throw std::runtime_error("Oops, something went wrong with flush controller");
+    void Tick(TimeNs) override {
+        if (_IsWorking) {
+            auto now = Now();
+            if (now - StartTime >= ExecutionTime) {
+                _IsWorking = false;
+                _IsEventReady = true;
+                FinishTime = now;
+            }
         }
+    }
 
-        WaitingTimeUs.AddDuration((int)(event.GetStageDuration() * 1000000));
+protected:
+    LatencyDistribution Distribution;
+    uint64_t RandomStream;
 
-        FinishedEventsBarrier = event.GetId();
+    TimeNs ExecutionTime = 0;
+};
 
-        return event;
-    }
+// ----------------------------
+// SizeScaledTimeProcessor: CPU cost depends on the request class and grows with its size
 
+class SizeScaledTimeProcessor : public ProcessorBase {
 public:
-    void Draw(Sprite toSprite) override {
-        auto width = toSprite.Width();
-        auto height = toSprite.Height();
+    struct ServiceModel {
+        TimeNs BaseTime = 0;
+        TimeNs PerKiBTime = 0;
+    };
 
-        auto minDimension = std::min(width, height);
-        auto yPos = height / 2 - minDimension / 2;
+    // indexed by EventType
+    using ServiceModels = std::array<ServiceModel, EventTypeCount>;
 
-        Vec2Si32 bottomLeft(0, yPos);
-        Vec2Si32 topRight(minDimension, yPos + minDimension);
+    SizeScaledTimeProcessor(const ServiceModels& models)
+        : Models(models)
+    {
+    }
 
-        DrawRectangle(toSprite, bottomLeft, topRight, Rgba(255, 255, 255, 255));
+    // idle processor with the same parameters
+    SizeScaledTimeProcessor Clone() const {
+        return SizeScaledTimeProcessor(Models);
+    }
 
-        char text[128];
-        snprintf(text, sizeof(text), "%s: %ld\np90: %d us",
-                 Name, WaitingEvents.size(), WaitingTimeUs.GetPercentile(90));
-        GetFont().Draw(toSprite, text, 10, yPos + minDimension / 2);
+    const ServiceModels& GetServiceModels() const {
+        return Models;
     }
 
-private:
-    const char* Name;
-    Histogram WaitingTimeUs;
+    // applies starting from the next event
+    void SetServiceModels(const ServiceModels& models) {
+        Models = models;
+    }
 
-    size_t FinishedEventsBarrier = 0; // all events with Id <= barrier are finished
-    std::set<Event> WaitingEvents;
-};
+    void StartWork(Event event) override {
+        ProcessorBase::StartWork(event);
+
+        const auto& model = Models[(size_t)event.GetType()];
+        ExecutionTime = model.BaseTime + model.PerKiBTime * (TimeNs)event.GetSize() / (TimeNs)KiB;
+    }
+
+    void Tick(TimeNs) override {
+        if (_IsWorking) {
+            auto now = Now();
+            if (now - StartTime >= ExecutionTime) {
+                _IsWorking = false;
+                _IsEventReady = true;
+                FinishTime = now;
+            }
+        }
+    }
+
+private:
+    ServiceModels Models;
+    TimeNs ExecutionTime = 0;
+};
+
+// ----------------------------
+// DeviceBandwidth: shared by all inflight requests of a device, active transfers split
+// the bandwidth equally, so a small transfer isn't queued behind the large ones
+
+class DeviceBandwidth {
+public:
+    using TransferId = size_t;
+
+    DeviceBandwidth(size_t bytesPerSecond)
+        : BytesPerSecond(bytesPerSecond)
+        , CreatedAt(Now())
+        , AdvancedTo(CreatedAt)
+    {
+        if (BytesPerSecond == 0) {
+            throw std::runtime_error("Device bandwidth must be positive");
+        }
+    }
+
+    TransferId StartTransfer(size_t size) {
+        Advance();
+        auto id = NextTransferId++;
+        ActiveTransfers.push_back({id, (double)size});
+        return id;
+    }
+
+    // time when the transfer has finished, nothing while it is active. Finished transfer
+    // is forgotten once taken
+    std::optional<TimeNs> TakeFinishedTransfer(TransferId id) {
+        Advance();
+        for (auto it = FinishedTransfers.begin(); it != FinishedTransfers.end(); ++it) {
+            if (it->first == id) {
+                auto finishTime = it->second;
+                FinishedTransfers.erase(it);
+                return finishTime;
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    void CountRequest(bool bandwidthBound) {
+        ++TotalRequests;
+        if (bandwidthBound) {
+            ++BandwidthBoundRequests;
+        }
+    }
+
+    double GetUtilization() const {
+        auto elapsed = Now() - CreatedAt;
+        if (elapsed <= 0) {
+            return 0;
+        }
+        return std::min(1.0, (double)BusyTime / elapsed);
+    }
+
+    // share of requests, which finished later because of their transfer than because of the latency
+    double GetBandwidthBoundShare() const {
+        if (TotalRequests == 0) {
+            return 0;
+        }
+        return (double)BandwidthBoundRequests / TotalRequests;
+    }
+
+    size_t GetBytesPerSecond() const {
+        return BytesPerSecond;
+    }
+
+    // active transfers continue at the new bandwidth
+    void SetBytesPerSecond(size_t bytesPerSecond) {
+        if (bytesPerSecond == 0) {
+            throw std::runtime_error("Device bandwidth must be positive");
+        }
+        Advance();
+        BytesPerSecond = bytesPerSecond;
+    }
+
+private:
+    struct Transfer {
+        TransferId Id;
+        double RemainingBytes;
+    };
+
+    // moves the active transfers to the current time: till the smallest one is done,
+    // all of them progress at the equal share of the bandwidth
+    void Advance() {
+        auto now = Now();
+        while (!ActiveTransfers.empty() && AdvancedTo < now) {
+            double bytesPerNs = (double)BytesPerSecond / Sec / ActiveTransfers.size();
+
+            double minRemaining = ActiveTransfers.front().RemainingBytes;
+            for (const auto& transfer: ActiveTransfers) {
+                minRemaining = std::min(minRemaining, transfer.RemainingBytes);
+            }
+
+            auto step = std::min((TimeNs)std::ceil(minRemaining / bytesPerNs), now - AdvancedTo);
+            AdvancedTo += step;
+            BusyTime += step;
+
+            double transferred = step * bytesPerNs;
+            auto it = ActiveTransfers.begin();
+            while (it != ActiveTransfers.end()) {
+                it->RemainingBytes -= transferred;
+                if (it->RemainingBytes <= 0) {
+                    FinishedTransfers.emplace_back(it->Id, AdvancedTo);
+                    it = ActiveTransfers.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        AdvancedTo = now;
+    }
+
+private:
+    size_t BytesPerSecond;
+    TimeNs CreatedAt;
+
+    TimeNs AdvancedTo;
+    TimeNs BusyTime = 0;
+
+    TransferId NextTransferId = 0;
+    std::vector<Transfer> ActiveTransfers;
+    std::vector<std::pair<TransferId, TimeNs>> FinishedTransfers;
+
+    size_t TotalRequests = 0;
+    size_t BandwidthBoundRequests = 0;
+};
+
+// ----------------------------
+// DeviceProcessor: request finishes when both its latency has passed and its data
+// has been transferred through the shared device bandwidth
+
+class DeviceProcessor : public PercentileTimeProcessor {
+public:
+    DeviceProcessor(
+            LatencyDistribution latency,
+            std::shared_ptr<DeviceBandwidth> bandwidth,
+            uint64_t randomStream = 0)
+        : PercentileTimeProcessor(std::move(latency), randomStream)
+        , Bandwidth(std::move(bandwidth))
+    {
+    }
+
+    DeviceProcessor Clone() const {
+        return DeviceProcessor(Distribution, Bandwidth, RandomStream);
+    }
+
+    void StartWork(Event event) override {
+        PercentileTimeProcessor::StartWork(event);
+
+        if (event.GetSize() != 0) {
+            ActiveTransfer = Bandwidth->StartTransfer(event.GetSize());
+        } else {
+            Bandwidth->CountRequest(false);
+        }
+    }
+
+    void Tick(TimeNs dt) override {
+        if (_IsWorking && ActiveTransfer) {
+            auto transferDone = Bandwidth->TakeFinishedTransfer(*ActiveTransfer);
+            if (!transferDone) {
+                return;
+            }
+
+            ActiveTransfer.reset();
+
+            bool bandwidthBound = *transferDone > StartTime + ExecutionTime;
+            if (bandwidthBound) {
+                ExecutionTime = *transferDone - StartTime;
+            }
+            Bandwidth->CountRequest(bandwidthBound);
+        }
+
+        PercentileTimeProcessor::Tick(dt);
+    }
+
+private:
+    std::shared_ptr<DeviceBandwidth> Bandwidth;
+    std::optional<DeviceBandwidth::TransferId> ActiveTransfer;
+};
+
+// ----------------------------
+// Executor
+
+template <typename ProcessorType>
+class Executor : public IPipeLineItem {
+public:
+
+    template<typename... Args>
+    Executor(const char* name, size_t processorCount, Args&&... args)
+        : Name(name)
+        , Prototype(std::forward<Args>(args)...)
+        , TargetProcessorCount(processorCount)
+        , BusyProcessorCount(0)
+    {
+        for (size_t i = 0; i < processorCount; ++i) {
+            Processors.emplace_back(Prototype.Clone());
+        }
+    }
+
+    void Tick(TimeNs dt) override {
+        BusyProcessorCount = 0;
+        ReadyEventsCount = 0;
+
+        for (auto& processor: Processors) {
+            processor.Tick(dt);
+            if (processor.IsBusy()) {
+                ++BusyProcessorCount;
+            }
+            if (processor.IsEventReady()) {
+                ++ReadyEventsCount;
+            }
+        }
+
+        if (Processors.size() > TargetProcessorCount) {
+            RemoveIdleProcessors();
+        }
+    }
+
+    bool IsReadyToPushEvent() const override {
+        return BusyProcessorCount < TargetProcessorCount;
+    }
+
+    void PushEvent(Event event) override {
+        if (!IsReadyToPushEvent()) {
+            throw std::runtime_error("Executor is full");
+        }
+
+        event.StartStage();
+
+        for (auto& processor: Processors) {
+            if (!processor.IsBusy()) {
+                processor.StartWork(event);
+                if (processor.IsBusy()) {
+                    ++BusyProcessorCount;
+                }
+                return;
+            }
+        }
+    }
+
+    bool IsReadyToPopEvent() const override {
+        return ReadyEventsCount > 0;
+    }
+
+    Event PopEvent() override {
+        if (!IsReadyToPopEvent()) {
+            throw std::runtime_error("No events ready");
+        }
+
+        for (auto& processor: Processors) {
+            if (processor.IsEventReady()) {
+                --ReadyEventsCount;
+                --BusyProcessorCount;
+                return processor.PopEvent();
+            }
+        }
+
+        throw std::runtime_error("No events ready");
+    }
+
+    size_t GetProcessorCount() const {
+        return TargetProcessorCount;
+    }
+
+    size_t GetBusyProcessorCount() const {
+        return BusyProcessorCount;
+    }
+
+    // when shrinking, busy processors are not interrupted: they are removed
+    // once their events are popped
+    void SetProcessorCount(size_t count) {
+        if (count == 0) {
+            throw std::runtime_error("Executor must have at least one processor");
+        }
+
+        TargetProcessorCount = count;
+        while (Processors.size() < TargetProcessorCount) {
+            Processors.emplace_back(Prototype.Clone());
+        }
+
+        RemoveIdleProcessors();
+    }
+
+    // changes parameters of all processors, including the ones created later
+    template <typename Func>
+    void Reconfigure(Func&& func) {
+        func(Prototype);
+        for (auto& processor: Processors) {
+            func(processor);
+        }
+    }
+
+    const ProcessorType& GetPrototype() const {
+        return Prototype;
+    }
+
+public:
+    void Draw(Sprite toSprite) override {
+        auto width = toSprite.Width();
+        auto height = toSprite.Height();
+
+        auto minDimension = std::min(width, height);
+        auto yPos = height / 2 - minDimension / 2;
+
+        Vec2Si32 bottomLeft(0, yPos);
+        Vec2Si32 topRight(minDimension, yPos + minDimension);
+
+        DrawRectangle(toSprite, bottomLeft, topRight, Rgba(255, 255, 255, 255));
+
+        char text[128];
+        if (Processors.size() > TargetProcessorCount) {
+            snprintf(text, sizeof(text), "%s:\n%ld/%ld\ndraining: %ld",
+                     Name, BusyProcessorCount, TargetProcessorCount, Processors.size() - TargetProcessorCount);
+        } else {
+            snprintf(text, sizeof(text), "%s:\n%ld/%ld", Name, BusyProcessorCount, TargetProcessorCount);
+        }
+        GetFont().Draw(toSprite, text, 10, yPos + minDimension / 2);
+    }
+
+private:
+    void RemoveIdleProcessors() {
+        for (auto it = Processors.begin(); it != Processors.end() && Processors.size() > TargetProcessorCount;) {
+            if (it->IsBusy()) {
+                ++it;
+            } else {
+                it = Processors.erase(it);
+            }
+        }
+    }
+
+private:
+    const char* Name;
+
+    ProcessorType Prototype;
+    std::vector<ProcessorType> Processors;
+    size_t TargetProcessorCount = 0;
+    size_t BusyProcessorCount = 0;
+    size_t ReadyEventsCount = 0;
+};
+
+// ----------------------------
+// DeviceExecutor: NVMe device, each inflight slot has own latency, but all of them share bandwidth
+
+class DeviceExecutor : public Executor<DeviceProcessor> {
+public:
+    DeviceExecutor(
+            const char* name,
+            size_t inflight,
+            LatencyDistribution latency,
+            std::shared_ptr<DeviceBandwidth> bandwidth)
+        : Executor<DeviceProcessor>(name, inflight, latency, bandwidth, StreamFromName(name))
+        , Bandwidth(std::move(bandwidth))
+    {
+    }
+
+public:
+    void Draw(Sprite toSprite) override {
+        Executor<DeviceProcessor>::Draw(toSprite);
+
+        auto width = toSprite.Width();
+        auto height = toSprite.Height();
+
+        auto minDimension = std::min(width, height);
+        auto yPos = height / 2 - minDimension / 2;
+
+        char text[128];
+        snprintf(text, sizeof(text), "BW: %ld MiB/s\nutil: %.0f%%\nbw-bound: %.0f%%",
+                 Bandwidth->GetBytesPerSecond() / MiB,
+                 Bandwidth->GetUtilization() * 100,
+                 Bandwidth->GetBandwidthBoundShare() * 100);
+        GetFont().Draw(toSprite, text, 10, yPos + minDimension / 2 - 80);
+    }
+
+    DeviceBandwidth& GetBandwidth() {
+        return *Bandwidth;
+    }
+
+private:
+    std::shared_ptr<DeviceBandwidth> Bandwidth;
+};
+
+// ----------------------------
+// MultiWorkerExecutor: each worker has own queue, events are distributed between workers
+// by the dispatch policy, which has own costs
+
+enum class DispatchPolicy {
+    SharedQueue,  // all workers take events from a single queue protected by a lock
+    Sharded,      // event is processed by the worker Id % workers, no balancing
+    WorkStealing, // sharded, but idle worker steals from the longest queue of other workers
+};
+
+const char* DispatchPolicyName(DispatchPolicy policy) {
+    switch (policy) {
+    case DispatchPolicy::SharedQueue:
+        return "shared";
+    case DispatchPolicy::Sharded:
+        return "sharded";
+    case DispatchPolicy::WorkStealing:
+        return "stealing";
+    }
+
+    return "unknown";
+}
+
+struct DispatchCosts {
+    TimeNs LockTime = 0;  // lock is held this long to take an event from the shared queue
+    TimeNs StealTime = 0; // extra time to take an event from the queue of another worker
+};
+
+template <typename ProcessorType>
+class MultiWorkerExecutor : public IPipeLineItem {
+public:
+    template<typename... Args>
+    MultiWorkerExecutor(
+            const char* name,
+            size_t workerCount,
+            DispatchPolicy policy,
+            DispatchCosts costs,
+            Args&&... args)
+        : Name(name)
+        , Policy(policy)
+        , Costs(costs)
+        , CreatedAt(Now())
+    {
+        if (workerCount == 0) {
+            throw std::runtime_error("Executor must have at least one worker");
+        }
+
+        ProcessorType prototype(std::forward<Args>(args)...);
+        for (size_t i = 0; i < workerCount; ++i) {
+            Workers.emplace_back(prototype.Clone());
+        }
+    }
+
+    void Tick(TimeNs dt) override {
+        ReadyEventsCount = 0;
+
+        for (size_t i = 0; i < Workers.size(); ++i) {
+            auto& worker = Workers[i];
+            worker.Processor.Tick(dt);
+
+            if (worker.Dispatching && worker.DispatchedAt <= Now()) {
+                worker.Processor.StartWork(*worker.Dispatching);
+                worker.Dispatching.reset();
+            }
+
+            if (!worker.IsBusy()) {
+                TryDispatch(i);
+            }
+
+            if (worker.IsBusy()) {
+                worker.BusyTime += dt;
+            }
+            if (worker.Processor.IsEventReady()) {
+                ++ReadyEventsCount;
+            }
+        }
+    }
+
+    bool IsReadyToPushEvent() const override {
+        // worker queues are infinite
+        return true;
+    }
+
+    void PushEvent(Event event) override {
+        event.StartStage();
+
+        if (Policy == DispatchPolicy::SharedQueue) {
+            SharedQueue.push_back(event);
+        } else {
+            Workers[event.GetId() % Workers.size()].Queue.push_back(event);
+        }
+
+        for (size_t i = 0; i < Workers.size(); ++i) {
+            if (!Workers[i].IsBusy()) {
+                TryDispatch(i);
+            }
+        }
+    }
+
+    bool IsReadyToPopEvent() const override {
+        return ReadyEventsCount > 0;
+    }
+
+    Event PopEvent() override {
+        if (!IsReadyToPopEvent()) {
+            throw std::runtime_error("No events ready");
+        }
+
+        for (size_t i = 0; i < Workers.size(); ++i) {
+            auto& worker = Workers[i];
+            if (worker.Processor.IsEventReady()) {
+                --ReadyEventsCount;
+                auto event = worker.Processor.PopEvent();
+                worker.LatencyUs.AddDuration(event.GetStageDuration());
+
+                // the freed worker takes its next event in the same tick, as Executor does
+                // when the pipeline pushes to it
+                TryDispatch(i);
+
+                return event;
+            }
+        }
+
+        throw std::runtime_error("No events ready");
+    }
+
+    DispatchPolicy GetPolicy() const {
+        return Policy;
+    }
+
+    // queued events are redistributed according to the new policy
+    void SetPolicy(DispatchPolicy policy) {
+        std::deque<Event> queued;
+        queued.swap(SharedQueue);
+        for (auto& worker: Workers) {
+            queued.insert(queued.end(), worker.Queue.begin(), worker.Queue.end());
+            worker.Queue.clear();
+        }
+
+        std::sort(queued.begin(), queued.end());
+
+        Policy = policy;
+        for (const auto& event: queued) {
+            if (Policy == DispatchPolicy::SharedQueue) {
+                SharedQueue.push_back(event);
+            } else {
+                Workers[event.GetId() % Workers.size()].Queue.push_back(event);
+            }
+        }
+    }
+
+    // share of time the worker was busy, including the dispatch overhead
+    double GetUtilization(size_t worker) const {
+        auto elapsed = Now() - CreatedAt;
+        if (elapsed <= 0) {
+            return 0;
+        }
+        return std::min(1.0, (double)Workers[worker].BusyTime / elapsed);
+    }
+
+public:
+    void Draw(Sprite toSprite) override {
+        constexpr size_t maxWorkersToDraw = 8;
+
+        auto width = toSprite.Width();
+        auto height = toSprite.Height();
+
+        auto minDimension = std::min(width, height);
+        auto yPos = height / 2 - minDimension / 2;
+
+        Vec2Si32 bottomLeft(0, yPos);
+        Vec2Si32 topRight(minDimension, yPos + minDimension);
+
+        DrawRectangle(toSprite, bottomLeft, topRight, Rgba(255, 255, 255, 255));
+
+        size_t busyCount = 0;
+        size_t queuedCount = SharedQueue.size();
+        for (const auto& worker: Workers) {
+            if (worker.IsBusy()) {
+                ++busyCount;
+            }
+            queuedCount += worker.Queue.size();
+        }
+
+        std::string text = Name;
+        text += " (" + std::string(DispatchPolicyName(Policy)) + "):\n";
+
+        char line[128];
+        snprintf(line, sizeof(line), "%ld/%ld, queued: %ld\nsteals: %ld, lock wait: %ld us\n",
+                 busyCount, Workers.size(), queuedCount, Steals, LockWaitTime / Usec);
+        text += line;
+
+        for (size_t i = 0; i < Workers.size() && i < maxWorkersToDraw; ++i) {
+            snprintf(line, sizeof(line), "w%ld: %.0f%% p90: %ld us\n",
+                     i, GetUtilization(i) * 100, Workers[i].LatencyUs.GetPercentile(90) / Usec);
+            text += line;
+        }
+        if (Workers.size() > maxWorkersToDraw) {
+            text += "...\n";
+        }
+
+        GetFont().Draw(toSprite, text.c_str(), 10, yPos + 10);
+    }
+
+private:
+    struct Worker {
+        Worker(ProcessorType processor)
+            : Processor(std::move(processor))
+            , LatencyUs(Histogram::HistogramWithUsBuckets())
+        {
+        }
+
+        bool IsBusy() const {
+            return Dispatching.has_value() || Processor.IsBusy();
+        }
+
+        ProcessorType Processor;
+        std::deque<Event> Queue;
+
+        // event is taken from a queue, but the worker is still paying the dispatch cost
+        std::optional<Event> Dispatching;
+        TimeNs DispatchedAt = 0;
+
+        TimeNs BusyTime = 0;
+        Histogram LatencyUs; // time since the event was pushed till it's popped
+    };
+
+    void TryDispatch(size_t workerIndex) {
+        auto& worker = Workers[workerIndex];
+        auto now = Now();
+
+        switch (Policy) {
+        case DispatchPolicy::SharedQueue: {
+            if (SharedQueue.empty()) {
+                return;
+            }
+
+            // lock acquisitions are serialized
+            auto lockStart = std::max(now, LockFreeAt);
+            LockFreeAt = lockStart + Costs.LockTime;
+            LockWaitTime += lockStart - now;
+
+            worker.Dispatching = SharedQueue.front();
+            worker.DispatchedAt = LockFreeAt;
+            SharedQueue.pop_front();
+            break;
+        }
+        case DispatchPolicy::Sharded:
+        case DispatchPolicy::WorkStealing: {
+            if (!worker.Queue.empty()) {
+                worker.Dispatching = worker.Queue.front();
+                worker.DispatchedAt = now;
+                worker.Queue.pop_front();
+                break;
+            }
+
+            if (Policy == DispatchPolicy::Sharded) {
+                return;
+            }
+
+            Worker* victim = nullptr;
+            for (auto& other: Workers) {
+                if (!other.Queue.empty() && (!victim || other.Queue.size() > victim->Queue.size())) {
+                    victim = &other;
+                }
+            }
+            if (!victim) {
+                return;
+            }
+
+            // steal from the back, the owner takes from the front
+            worker.Dispatching = victim->Queue.back();
+            worker.DispatchedAt = now + Costs.StealTime;
+            victim->Queue.pop_back();
+            ++Steals;
+            break;
+        }
+        }
+
+        if (worker.DispatchedAt <= now) {
+            worker.Processor.StartWork(*worker.Dispatching);
+            worker.Dispatching.reset();
+        }
+    }
+
+private:
+    const char* Name;
+    DispatchPolicy Policy;
+    DispatchCosts Costs;
+    TimeNs CreatedAt;
+
+    std::vector<Worker> Workers;
+    std::deque<Event> SharedQueue;
+    size_t ReadyEventsCount = 0;
+
+    TimeNs LockFreeAt = 0;
+    TimeNs LockWaitTime = 0;
+    size_t Steals = 0;
+};
+
+// ----------------------------
+// FlushController: events should wait all previous events to finish
+
+class FlushController : public IPipeLineItem {
+public:
+    FlushController(const char* name)
+        : Name(name)
+        , WaitingTimeUs(Histogram::HistogramWithUsBuckets())
+    {
+    }
+
+    void Tick(TimeNs) override {
+        /* do nothing */
+    }
+
+    bool IsReadyToPushEvent() const override {
+        return true;
+    }
+
+    void PushEvent(Event event) override {
+        event.StartStage();
+        WaitingEvents.insert(event);
+    }
+
+    bool IsReadyToPopEvent() const override {
+        if (WaitingEvents.empty()) {
+            return false;
+        }
+
+        size_t lowestId = WaitingEvents.begin()->GetId();
+        return lowestId - 1 == FinishedEventsBarrier;
+    }
+
+    Event PopEvent() override {
+        if (!IsReadyToPopEvent()) {
+            throw std::runtime_error("No events ready");
+        }
+
+        auto iter = WaitingEvents.begin();
+        auto event = *iter;
+        WaitingEvents.erase(iter);
+
+        if (event.GetId() - 1 != FinishedEventsBarrier) {
+            throw std::runtime_error("Oops, something went wrong with flush controller");
+        }
+
+        WaitingTimeUs.AddDuration(event.GetStageDuration());
+
+        FinishedEventsBarrier = event.GetId();
+
+        return event;
+    }
+
+public:
+    void Draw(Sprite toSprite) override {
+        auto width = toSprite.Width();
+        auto height = toSprite.Height();
+
+        auto minDimension = std::min(width, height);
+        auto yPos = height / 2 - minDimension / 2;
+
+        Vec2Si32 bottomLeft(0, yPos);
+        Vec2Si32 topRight(minDimension, yPos + minDimension);
+
+        DrawRectangle(toSprite, bottomLeft, topRight, Rgba(255, 255, 255, 255));
+
+        char text[128];
+        snprintf(text, sizeof(text), "%s: %ld\np90: %ld us",
+                 Name, WaitingEvents.size(), WaitingTimeUs.GetPercentile(90) / Usec);
+        GetFont().Draw(toSprite, text, 10, yPos + minDimension / 2);
+    }
+
+private:
+    const char* Name;
+    Histogram WaitingTimeUs;
+
+    size_t FinishedEventsBarrier = 0; // all events with Id <= barrier are finished
+    std::set<Event> WaitingEvents;
+};
 
 // ----------------------------
 // ClosedPipeLine
@@ -597,30 +1669,103 @@ private:
 // assumes, that the first stage is the input queue. Finished events are pushed back to the input queue
 class ClosedPipeLine {
 public:
-    ClosedPipeLine(Sprite sprite)
+    // stats of the events finished since the previous batch, percentiles are exact
+    struct BatchStats {
+        size_t Events = 0;
+        double Rps = 0;
+        TimeNs P50 = 0;
+        TimeNs P90 = 0;
+        TimeNs P99 = 0;
+    };
+
+    // pipelines with the same seed generate the same events with the same random draws
+    ClosedPipeLine(Sprite sprite, uint64_t seed = RandomSeed())
         : _Sprite(sprite)
         , EventDurationsUs(Histogram::HistogramWithUsBuckets())
+        , _Workload(Workload::SingleClass(EventType::LogWrite, 4 * KiB))
+        , Seed(seed)
+    {
+    }
+
+    // applies to the events generated from now on, so the initial events of the input
+    // queue use it only when set before adding the queue
+    void SetWorkload(Workload workload) {
+        _Workload = std::move(workload);
+    }
+
+    // Add* methods return the stage, which stays owned by the pipeline, so that
+    // it can be reconfigured at runtime
+
+    Queue* AddQueue(const char* name, size_t initialEvents = 0) {
+        auto* queue = new Queue(name);
+        Stages.emplace_back(queue);
+
+        for (size_t i = 0; i < initialEvents; ++i) {
+            queue->PushEvent(NewEvent());
+        }
+
+        return queue;
+    }
+
+    Executor<FixedTimeProcessor>* AddFixedTimeExecutor(const char* name, size_t processorCount, TimeNs executionTime) {
+        auto* executor = new Executor<FixedTimeProcessor>(name, processorCount, executionTime);
+        Stages.emplace_back(executor);
+        return executor;
+    }
+
+    Executor<PercentileTimeProcessor>* AddPercentileTimeExecutor(
+        const char* name,
+        size_t processorCount,
+        LatencyDistribution latency)
     {
+        auto* executor = new Executor<PercentileTimeProcessor>(name, processorCount, latency, StreamFromName(name));
+        Stages.emplace_back(executor);
+        return executor;
     }
 
-    void AddQueue(const char* name, size_t initialEvents = 0) {
-        Stages.emplace_back(new Queue(name, initialEvents));
+    Executor<SizeScaledTimeProcessor>* AddSizeScaledExecutor(
+        const char* name,
+        size_t processorCount,
+        const SizeScaledTimeProcessor::ServiceModels& models)
+    {
+        auto* executor = new Executor<SizeScaledTimeProcessor>(name, processorCount, models);
+        Stages.emplace_back(executor);
+        return executor;
     }
 
-    void AddFixedTimeExecutor(const char* name, size_t processorCount, double executionTime) {
-        Stages.emplace_back(new Executor<FixedTimeProcessor>(name, processorCount, executionTime));
+    DeviceExecutor* AddDevice(
+        const char* name,
+        size_t inflight,
+        LatencyDistribution latency,
+        size_t bytesPerSecond)
+    {
+        auto bandwidth = std::make_shared<DeviceBandwidth>(bytesPerSecond);
+        auto* device = new DeviceExecutor(name, inflight, std::move(latency), std::move(bandwidth));
+        Stages.emplace_back(device);
+        return device;
     }
 
-    void AddPercentileTimeExecutor(const char* name, size_t processorCount, PercentileTimeProcessor::Percentiles percentiles) {
-        Stages.emplace_back(new Executor<PercentileTimeProcessor>(name, processorCount, percentiles));
+    MultiWorkerExecutor<SizeScaledTimeProcessor>* AddMultiWorkerExecutor(
+        const char* name,
+        size_t workerCount,
+        DispatchPolicy policy,
+        DispatchCosts costs,
+        const SizeScaledTimeProcessor::ServiceModels& models)
+    {
+        auto* executor = new MultiWorkerExecutor<SizeScaledTimeProcessor>(name, workerCount, policy, costs, models);
+        Stages.emplace_back(executor);
+        return executor;
     }
 
-    void AddFlushController(const char* name) {
-        Stages.emplace_back(new FlushController(name));
+    FlushController* AddFlushController(const char* name) {
+        auto* controller = new FlushController(name);
+        Stages.emplace_back(controller);
+        return controller;
     }
 
-    void Tick(double dt) {
+    void Tick(TimeNs dt) {
         TotalTimePassed += dt;
+        BatchTimePassed += dt;
 
         for (auto& stage: Stages) {
             stage->Tick(dt);
@@ -659,13 +1804,66 @@ public:
             auto event = lastStage->PopEvent();
 
             ++TotalFinishedEvents;
-            EventDurationsUs.AddDuration((int)(event.GetDuration() * 1000000));
+            TotalFinishedBytes += event.GetSize();
+            EventDurationsUs.AddDuration(event.GetDuration());
+
+            ++BatchFinishedEvents;
+            if (CollectBatchDurations) {
+                BatchDurations.push_back(event.GetDuration());
+            }
 
-            auto newEvent = Event::NewEvent();
+            auto newEvent = NewEvent();
             inputQueue->PushEvent(newEvent);
         }
 
-        AvgRPS = (size_t)(TotalFinishedEvents / TotalTimePassed);
+        AvgRPS = (size_t)(TotalFinishedEvents / ToSeconds(TotalTimePassed));
+        AvgBytesPerSecond = (size_t)(TotalFinishedBytes / ToSeconds(TotalTimePassed));
+    }
+
+    // forgets finished events, e.g. after the warmup. Events in flight are kept
+    void ResetStats() {
+        TotalFinishedEvents = 0;
+        TotalFinishedBytes = 0;
+        TotalTimePassed = 0;
+        EventDurationsUs = Histogram::HistogramWithUsBuckets();
+        AvgRPS = 0;
+        AvgBytesPerSecond = 0;
+    }
+
+    // batch percentiles are computed from the raw durations, which are kept only
+    // when enabled, because nothing else drains them
+    void EnableBatchStats() {
+        CollectBatchDurations = true;
+    }
+
+    BatchStats TakeBatchStats() {
+        if (!CollectBatchDurations) {
+            throw std::runtime_error("Batch stats are not enabled");
+        }
+
+        BatchStats stats;
+        stats.Events = BatchFinishedEvents;
+        if (BatchTimePassed > 0) {
+            stats.Rps = BatchFinishedEvents / ToSeconds(BatchTimePassed);
+        }
+        stats.P50 = TakeBatchPercentile(50);
+        stats.P90 = TakeBatchPercentile(90);
+        stats.P99 = TakeBatchPercentile(99);
+
+        BatchFinishedEvents = 0;
+        BatchTimePassed = 0;
+        BatchDurations.clear();
+
+        return stats;
+    }
+
+    size_t GetAvgRps() const {
+        return AvgRPS;
+    }
+
+    // end-to-end latency of finished events
+    TimeNs GetPercentile(int percentile) {
+        return EventDurationsUs.GetPercentile(percentile);
     }
 
 public:
@@ -694,27 +1892,135 @@ public:
 
         char text[512];
         snprintf(text, sizeof(text),
-            "TimePassed: %.2f s, Events: %ld, AvgRPS: %ld\np10: %d us, p50: %d us, p90: %d us, p99: %d us, p100: %d us",
-            TotalTimePassed,
+            "TimePassed: %.2f s, Events: %ld, AvgRPS: %ld, AvgBW: %ld MiB/s\np10: %ld us, p50: %ld us, p90: %ld us, p99: %ld us, p100: %ld us",
+            ToSeconds(TotalTimePassed),
             TotalFinishedEvents,
             AvgRPS,
-            EventDurationsUs.GetPercentile(10),
-            EventDurationsUs.GetPercentile(50),
-            EventDurationsUs.GetPercentile(90),
-            EventDurationsUs.GetPercentile(99),
-            EventDurationsUs.GetPercentile(100)
+            AvgBytesPerSecond / MiB,
+            EventDurationsUs.GetPercentile(10) / Usec,
+            EventDurationsUs.GetPercentile(50) / Usec,
+            EventDurationsUs.GetPercentile(90) / Usec,
+            EventDurationsUs.GetPercentile(99) / Usec,
+            EventDurationsUs.GetPercentile(100) / Usec
         );
         GetFont().Draw(_Sprite, text, spacing, spacing);
     }
 
+private:
+    // nearest-rank percentile, reorders BatchDurations
+    TimeNs TakeBatchPercentile(int percentile) {
+        if (BatchDurations.empty()) {
+            return 0;
+        }
+
+        size_t rank = (size_t)std::ceil(percentile / 100.0 * BatchDurations.size());
+        auto nth = BatchDurations.begin() + (rank == 0 ? 0 : rank - 1);
+        std::nth_element(BatchDurations.begin(), nth, BatchDurations.end());
+        return *nth;
+    }
+
+    Event NewEvent() {
+        ++EventCounter;
+        return _Workload.NewEvent(EventCounter, MixBits(Seed + EventCounter));
+    }
+
 private:
     std::deque<PipeLineItemPtr> Stages;
 
     size_t TotalFinishedEvents = 0;
-    double TotalTimePassed = 0;
+    size_t TotalFinishedBytes = 0;
+    TimeNs TotalTimePassed = 0;
 
     Histogram EventDurationsUs;
     size_t AvgRPS = 0;
+    size_t AvgBytesPerSecond = 0;
+
+    size_t BatchFinishedEvents = 0;
+    TimeNs BatchTimePassed = 0;
+    bool CollectBatchDurations = false;
+    std::vector<TimeNs> BatchDurations;
+
+    Workload _Workload;
+    uint64_t Seed;
+    size_t EventCounter = 0;
+
+private:
+    Sprite _Sprite;
+};
+
+// ----------------------------
+// ModelControls: model parameters, which can be changed from keyboard while simulation is running
+
+class ModelControls {
+public:
+    struct Knob {
+        std::string Name;
+        std::function<std::string()> Value;
+        std::function<void(int)> Adjust; // called with +1 or -1
+    };
+
+    ModelControls(Sprite sprite)
+        : _Sprite(sprite)
+    {
+    }
+
+    void AddKnob(std::string name, std::function<std::string()> value, std::function<void(int)> adjust) {
+        Knobs.push_back({std::move(name), std::move(value), std::move(adjust)});
+    }
+
+    template <typename ProcessorType>
+    void AddProcessorCountKnob(std::string name, Executor<ProcessorType>* executor, size_t step = 1) {
+        AddKnob(
+            std::move(name),
+            [executor] {
+                return std::to_string(executor->GetProcessorCount());
+            },
+            [executor, step](int direction) {
+                auto count = executor->GetProcessorCount();
+                if (direction > 0) {
+                    executor->SetProcessorCount(count + step);
+                } else if (count > step) {
+                    executor->SetProcessorCount(count - step);
+                } else {
+                    executor->SetProcessorCount(1);
+                }
+            });
+    }
+
+    // Up/Down select a knob, Left/Right change it
+    void HandleInput() {
+        if (Knobs.empty()) {
+            return;
+        }
+
+        if (IsKeyDownward(kKeyUp)) {
+            Selected = (Selected + Knobs.size() - 1) % Knobs.size();
+        }
+        if (IsKeyDownward(kKeyDown)) {
+            Selected = (Selected + 1) % Knobs.size();
+        }
+        if (IsKeyDownward(kKeyRight)) {
+            Knobs[Selected].Adjust(+1);
+        }
+        if (IsKeyDownward(kKeyLeft)) {
+            Knobs[Selected].Adjust(-1);
+        }
+    }
+
+public:
+    void Draw() {
+        std::string text = "Up/Down: select, Left/Right: change\n";
+        for (size_t i = 0; i < Knobs.size(); ++i) {
+            text += (i == Selected ? "> " : "  ");
+            text += Knobs[i].Name + ": " + Knobs[i].Value() + "\n";
+        }
+
+        GetFont().Draw(_Sprite, text.c_str(), 5, 5);
+    }
+
+private:
+    std::vector<Knob> Knobs;
+    size_t Selected = 0;
 
 private:
     Sprite _Sprite;